@@ -32,6 +32,11 @@
 #include <sys/types.h>
 #include <dirent.h>
 #include <ctype.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <math.h>
 
 #ifndef SIGHUP
   #define SIGHUP 1
@@ -39,6 +44,31 @@
 #ifndef SIGQUIT
   #define SIGQUIT 3
 #endif
+#ifndef O_BINARY
+  #define O_BINARY 0
+#endif
+#ifndef _WIN32
+  #include <sys/mman.h>
+  #include <sys/wait.h>
+#endif
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+  #define MAP_ANONYMOUS MAP_ANON
+#endif
+#ifdef _WIN32
+  #include <io.h>
+  #include <windows.h>
+  #define fsync _commit
+#endif
+#ifdef __linux__
+  #include <sys/ioctl.h>
+  #include <linux/fs.h>
+  #include <linux/fiemap.h>
+  #include <sys/syscall.h>
+  #include <sys/uio.h>
+  #define IOPRIO_CLASS_IDLE   3
+  #define IOPRIO_CLASS_SHIFT 13
+  #define IOPRIO_WHO_PROCESS  1
+#endif
 
 #define PROG_VER \
 "ccsrch 1.1.0 (C) 2024 Julian Fondren <julian.fondren@newfold.com>\n" \
@@ -50,9 +80,18 @@
 #define BSIZE       4096
 #define CARDTYPELEN   64
 #define CARDSIZE      17
+#define RANGE_OVERLAP 256
+#define IOALIGN     4096
+#define IOBUFSIZE   (256 * 1024)
+#define IOPAD         64
+#define DIRECT_MIN  (8 * 1024 * 1024)
+#define SAMPLE_BLOCK (1024 * 1024)
+#define PREFETCH_BYTES (1024 * 1024)
 
-static char   ccsrch_buf[BSIZE];
-static char   lastfilename[MAXPATH];
+static char  *ccsrch_buf           = NULL;
+static char  *io_buf               = NULL;
+static long   scan_offset          = 0;
+static int    scan_counter         = 0;
 static char  *exclude_extensions;
 static char  *logfilename          = NULL;
 static const char  *currfilename   = NULL;
@@ -63,6 +102,7 @@ static long   file_count           = 0;
 static long   currfile_atime       = 0;
 static long   currfile_mtime       = 0;
 static long   currfile_ctime       = 0;
+static long   currfile_size        = -1;   /* from the last stat, -1 if unknown */
 static time_t init_time            = 0;
 static int    cardbuf[CARDSIZE];
 static int    print_byte_offset    = 0;
@@ -74,6 +114,13 @@ static int    ccsrch_index         = 0;
 static int    tracksrch            = 0;
 static int    tracktype1           = 0;
 static int    tracktype2           = 0;
+static int    track_mode           = 0;
+static char  *cache_file           = NULL;
+static int    cache_trust_sample   = 0;
+static int    cache_recording      = 0;     /* noting this file's hits for the cache */
+static int    cache_replaying      = 0;     /* putting out hits from the cache */
+static int    cache_replay_track   = 0;
+static long   cache_skipped        = 0;
 static int    trackdatacount       = 0;
 static int    file_hit_count       = 0;
 static int    limit_file_results   = 0;
@@ -85,9 +132,237 @@ static int    limit_ascii          = 0;
 static int    ignore_count         = 0;
 static int    dirs_from_stdin      = 0;
 static int    files_from_stdin     = 0;
+static int    input_delim          = '\n';
+static int    prefetch_window      = 0;
+static int    raw_mode             = 0;
+static int    raw_workers          = 1;
+static int    raw_scanning         = 0;
+static char  *pid_list             = NULL;    /* --pid: processes to scan */
+static int    mem_scanning         = 0;
+static int    walk_dir_fd          = -1;
+static const char *walk_name       = NULL;   /* file being scanned, relative to walk_dir_fd */
+
+/*
+ * The path of the walk so far. It is grown as needed and shared by every
+ * level of the walk, so a walk soon makes no allocations at all.
+ */
+static struct {
+  char    *buf;
+  size_t   len;
+  size_t   size;
+} walk_path;
+static char  *owner_map_root       = NULL;
+
+/*
+ * --owner-map: the extents of every file under a mountpoint, sorted by
+ * their physical offset, so a hit on the raw device can be put down to
+ * the file that holds it.
+ */
+struct owner_extent {
+  unsigned long long  physical;
+  unsigned long long  length;
+  size_t              path;     /* offset into owner_map.paths */
+};
+
+static struct {
+  struct owner_extent  *extents;
+  size_t                count;
+  size_t                size;
+  char                 *paths;
+  size_t                paths_used;
+  size_t                paths_size;
+  dev_t                 dev;      /* the filesystem's device */
+} owner_map;
 static int    print_csv            = 0;
+static int    output_format        = 0;     /* FORMAT_TEXT and so on */
+static long   binary_file_serial   = -1;
+static char  *convert_file         = NULL;
+
+#define FORMAT_TEXT   0
+#define FORMAT_JSON   1
+#define FORMAT_BINARY 2
+
+#define BINARY_MAGIC  "CCSRCHB1"
+static char  *checkpoint_file      = NULL;
+static int    checkpoint_interval  = 60;
+static int    resume_scan          = 0;
+static time_t last_checkpoint      = 0;
+static long   input_index          = 0;
+static int    input_is_file        = 0;     /* the current input is the file being scanned */
+static long   resume_input         = 0;
+static char  *resume_cursor        = NULL;
+static volatile sig_atomic_t stop_scan = 0;
+static char  *plan_out_file        = NULL;
+static FILE  *plan_out             = NULL;
+static char  *plan_file            = NULL;
+static int    shard_index          = 1;
+static int    shard_count          = 1;
+static long   scan_range_lo        = 0;
+static long   scan_range_hi        = -1;
+static long   plan_files           = 0;
+static long   plan_bytes           = 0;
+static int    gentle_io            = 0;
+static int    direct_io            = 0;
+static int    idle_io              = 0;
+static int    nice_level           = 0;
+static double adaptive_latency     = 0;
+static double duty_cycle           = 1;
+
+/*
+ * Rate limits: each bucket holds up to a second's worth of tokens and may
+ * go into debt, which is paid off by sleeping.
+ */
+struct token_bucket {
+  double rate;       /* tokens per second, 0 for no limit */
+  double tokens;
+  double last;       /* when the bucket was last topped up */
+};
+
+static struct token_bucket byte_bucket;
+static struct token_bucket file_bucket;
+static struct token_bucket open_bucket;
+
+enum { ORDER_WALK, ORDER_INODE, ORDER_EXTENT, ORDER_PRIORITY };
+static int    scan_order           = ORDER_WALK;
+static int    triage_mode          = 0;
+static long   sample_threshold     = 256L * 1024 * 1024;
+static int    sample_blocks        = 16;
+static int    currfile_sampled     = 0;
+static int    currfile_not_ascii   = 0;     /* -a gave up on the current file */
+static int    aggregate_mode       = 0;
+static int    aggregate_only       = 0;
+static char  *aggregate_key        = NULL;
+static long   aggregate_max        = 1000000;
+
+#define SKETCH_BITS 12
+#define AGG_NAME_BYTES 256      /* bytes of names kept per --aggregate-max */
+
+/*
+ * --aggregate: distinct card numbers, keyed by a SipHash of the number,
+ * with a count and where each was first and last seen; and hits per
+ * directory. Names live in one string pool and are referenced by offset.
+ */
+struct agg_pan {
+  uint64_t     hash;         /* 0 marks an empty slot */
+  const char  *type;
+  char         masked[20];
+  long         count;
+  size_t       first_path;
+  long         first_offset;
+  size_t       last_path;
+  long         last_offset;
+};
+
+struct agg_dir {
+  uint64_t     hash;
+  size_t       path;
+  long         hits;
+  long         files;
+};
+
+static struct {
+  uint64_t         key[2];
+  struct agg_pan  *pans;
+  size_t           pans_size;
+  size_t           pans_used;
+  struct agg_dir  *dirs;
+  size_t           dirs_size;
+  size_t           dirs_used;
+  struct agg_dir   other_dirs;    /* what doesn't fit under the cap */
+  unsigned char   *sketch;        /* HyperLogLog registers, once over the cap */
+  char            *pool;
+  size_t           pool_size;
+  size_t           pool_used;
+  long             file_serial;
+  size_t           file_path;
+  struct agg_dir  *file_dir;
+} agg;
+static long   triage_confirmed     = 0;
+static long   triage_sampled       = 0;
+static long   triage_clean         = 0;
+static long   triage_unreadable    = 0;
+
+/*
+ * With --order, files are collected in batches and each batch is scanned
+ * sorted by where the files live on disk; with --priority, by how likely
+ * they are to hold card data. Paths are kept in one pool per batch; the
+ * batch is flushed when it holds --batch files.
+ */
+struct batch_item {
+  size_t              path;     /* offset into batch.paths */
+  unsigned long long  dev;
+  unsigned long long  key;      /* inode, first physical block or rank */
+  long                atime;
+  long                mtime;
+  long                ctime;
+  long                size;
+};
+
+static struct {
+  struct batch_item  *items;
+  size_t              count;
+  size_t              limit;
+  char               *paths;
+  size_t              paths_used;
+  size_t              paths_size;
+  size_t              last;     /* latest file in walk order */
+  long                input;    /* input_index when it was queued */
+  int                 flushing;
+  size_t              items_size;
+} batch = { NULL, 0, 0, NULL, 0, 0, 0, 0, 0, 0 };
+
+/*
+ * --priority: each rule that matches a file adds its weight to the file's
+ * score, and the highest scores are scanned first.
+ */
+enum { RULE_EXT, RULE_PATH, RULE_LARGER, RULE_SMALLER, RULE_NEWER, RULE_OLDER };
+
+struct priority_rule {
+  int     type;
+  char   *arg;      /* extension list or path pattern */
+  double  value;    /* size in bytes or age in seconds */
+  int     weight;
+};
+
+static struct priority_rule *priority_rules      = NULL;
+static int                   priority_rule_count = 0;
+static time_t                deadline            = 0;
+static int                   deadline_passed     = 0;
+static char                 *unreached_file      = NULL;
+static FILE                 *unreached_out       = NULL;
+static long                  unreached_count     = 0;
+static long                  partial_count       = 0;
+
+static const char default_priority_policy[] =
+  "ext .csv,.txt,.log,.xls,.xlsx,.xlsm,.ods,.doc,.docx,.rtf,.xml,.json 40\n"
+  "ext .sql,.db,.sqlite,.mdb,.accdb,.dbf,.bak,.dmp,.dat,.out,.tmp 30\n"
+  "ext .iso,.img,.vmdk,.qcow2,.jpg,.jpeg,.png,.gif,.mp3,.mp4,.avi,.mov -40\n"
+  "ext .exe,.dll,.so,.o,.a,.jar,.class,.pyc,.woff,.ttf -30\n"
+  "path */log/* 20\n"
+  "path */logs/* 20\n"
+  "path */tmp/* 10\n"
+  "smaller 64 10\n"
+  "larger 1024 -30\n"
+  "newer 30 20\n"
+  "older 1825 -10\n";
+
+/*
+ * Progress as of the last fully scanned file. This, rather than the live
+ * counters, is what goes into a checkpoint, so that a file interrupted
+ * half way is scanned again from the start on resume.
+ */
+static struct {
+  long    input;       /* index of the top-level path being walked */
+  char   *cursor;      /* last completed file, in walk order */
+  size_t  cursor_size;
+  long    files;
+  long    hits;
+  int     tracks;
+  long    log_offset;  /* -o log size once those hits were written */
+} done;
 
 static void initialize_buffer(void);
+static void cache_note_hit(const char *cardname, const char *pan, long offset, int track);
 static void cleanup_shtuff(int);
 static void signal_proc(void);
 static int open_logfile(void);
@@ -115,7 +390,6 @@ static int track1_srch(int cardlen)
       && (ccsrch_buf[ccsrch_index-cardlen] == 'B')
       && (ccsrch_buf[ccsrch_index+2] > '@')
       && (ccsrch_buf[ccsrch_index+2] < '[')) {
-    trackdatacount++;
     return 1;
   } else {
     return 0;
@@ -132,7 +406,6 @@ static int track2_srch(int cardlen)
       && (ccsrch_buf[ccsrch_index+2] < ':'))
       && ((ccsrch_buf[ccsrch_index+3] > '/')
       && (ccsrch_buf[ccsrch_index+3] < ':'))) {
-    trackdatacount++;
     return 1;
   }
   else {
@@ -140,740 +413,4616 @@ static int track2_srch(int cardlen)
   }
 }
 
-static void print_result(const char *cardname, int cardlen, long byte_offset)
+/*
+ * Which track layout, if any, the current hit sits in: 1, 2 or 0, and
+ * for a hit from the cache, the one recorded then.
+ */
+static int hit_track(int cardlen)
 {
-  int		i;
-  char	nbuf[20];
-  char	buf[MAXPATH];
-  char	basebuf[MDBUFSIZE];
-  char	bytebuf[MDBUFSIZE];
-  char	datebuf[MDBUFSIZE];
-  char	mdatebuf[CARDTYPELEN];
-  char	adatebuf[CARDTYPELEN];
-  char	cdatebuf[CARDTYPELEN];
-  char	trackbuf[MDBUFSIZE];
-  int   char_before = ccsrch_index - cardlen - ignore_count;
+  if (cache_replaying)
+    return cache_replay_track;
+  if (track1_srch(cardlen))
+    return 1;
+  if (track2_srch(cardlen))
+    return 2;
+  return 0;
+}
 
-  /* If char directly before or after card are a number, don't print */
-  if ((char_before >= 0 && isdigit(ccsrch_buf[char_before])) ||
-      isdigit(ccsrch_buf[ccsrch_index+1]))
-    return;
+/*
+ * Length of the UTF-8 sequence at p, or 0 if it isn't a valid one:
+ * overlong forms, surrogates and code points past U+10FFFF are refused.
+ */
+static int utf8_len(const unsigned char *p)
+{
+  int n;
+  int i;
 
-  memset(&nbuf, '\0', sizeof(nbuf));
+  if (*p < 0xc2 || *p > 0xf4)
+    return 0;
+  n = *p < 0xe0 ? 2 : *p < 0xf0 ? 3 : 4;
+  for (i=1; i<n; i++)
+    if ((p[i] & 0xc0) != 0x80)
+      return 0;
+  if ((*p == 0xe0 && p[1] < 0xa0) || (*p == 0xed && p[1] >= 0xa0) ||
+      (*p == 0xf0 && p[1] < 0x90) || (*p == 0xf4 && p[1] >= 0x90))
+    return 0;
+  return n;
+}
 
-  for (i=0; i<cardlen; i++)
-    nbuf[i] = cardbuf[i]+'0';
+/*
+ * Write a JSON string. Bytes that aren't valid UTF-8 (a filename can be
+ * any bytes) are written as the code point of the same value, so the
+ * line always parses.
+ */
+static void json_string(FILE *out, const char *str)
+{
+  const unsigned char *p = (const unsigned char *)str;
+  int                  n;
 
-  if (ignore && strstr(ignore, nbuf) != NULL)
+  if (str == NULL) {
+    fputs("null", out);
     return;
+  }
+  putc('"', out);
+  while (*p != '\0') {
+    n = *p < 0x80 ? 1 : utf8_len(p);
+    if (n > 1) {
+      fwrite(p, 1, n, out);
+      p += n;
+    } else if (*p == '"' || *p == '\\') {
+      fprintf(out, "\\%c", *p++);
+    } else if (*p < 0x20 || *p >= 0x7f) {
+      fprintf(out, "\\u%04x", *p++);
+    } else {
+      putc(*p++, out);
+    }
+  }
+  putc('"', out);
+}
 
-  memset(&buf,'\0',MAXPATH);
-  memset(&basebuf,'\0',MDBUFSIZE);
-  
-  /* Mask the card if specified */
-  if (mask_card_number)
-    mask_pan(nbuf);
+/* A hit as one JSON object per line; every field is always there. */
+static void json_hit(FILE *out, const char *file, const char *type, const char *pan,
+                     long offset, long mtime, long atime, long c_time,
+                     const char *track, const char *owner)
+{
+  fputs("{\"file\":", out);
+  json_string(out, file);
+  fputs(",\"type\":", out);
+  json_string(out, type);
+  fputs(",\"pan\":", out);
+  json_string(out, pan);
+  fprintf(out, ",\"offset\":%ld,\"mtime\":%ld,\"atime\":%ld,\"ctime\":%ld,\"track\":",
+          offset, mtime, atime, c_time);
+  json_string(out, track);
+  fputs(",\"owner\":", out);
+  json_string(out, owner);
+  fputs("}\n", out);
+}
 
-  /* MB we need to figure out how to update the count and spit out the final
-  filename with the count.  ensure that it gets flushed out on the last match
-  if you are doing a diff between previous filename and new filename */
+static void json_status(FILE *out, const char *file, const char *status)
+{
+  fputs("{\"file\":", out);
+  json_string(out, file);
+  fputs(",\"status\":", out);
+  json_string(out, status);
+  fputs("}\n", out);
+}
 
-  if (print_filename_only) {
-    snprintf(basebuf, MDBUFSIZE, "%s", currfilename);
-  } else if (print_csv) {
-    // currfilename at the end so CSV is easier to repair if a filename has commas
-    snprintf(basebuf, MDBUFSIZE, "%s,%s,%s", nbuf, cardname, currfilename);
-  } else {
-    snprintf(basebuf, MDBUFSIZE, "%s\t%s\t%s", currfilename, cardname, nbuf);
+/* A CSV field, quoted when it has to be. */
+static void csv_field(FILE *out, const char *str, int last)
+{
+  if (str != NULL && strpbrk(str, ",\"\r\n") != NULL) {
+    putc('"', out);
+    for (; *str != '\0'; str++) {
+      if (*str == '"')
+        putc('"', out);
+      putc(*str, out);
+    }
+    putc('"', out);
+  } else if (str != NULL) {
+    fputs(str, out);
   }
+  putc(last ? '\n' : ',', out);
+}
 
-  snprintf(buf+strlen(buf), MAXPATH-strlen(buf), "%s", basebuf);
-
-  if (print_byte_offset) {
-    memset(&bytebuf,'\0',MDBUFSIZE);
-    snprintf(bytebuf, MDBUFSIZE, "\t%ld", byte_offset);
-    snprintf(buf+strlen(buf), MAXPATH-strlen(buf), "%s", bytebuf);
-  }
-  if (print_julian_time) {
-    snprintf(mdatebuf, CARDTYPELEN, "%s", ctime((time_t *)&currfile_mtime));
-    mdatebuf[strlen(mdatebuf)-1] = '\0';
-    snprintf(adatebuf, CARDTYPELEN, "%s", ctime((time_t *)&currfile_atime));
-    adatebuf[strlen(mdatebuf)-1] = '\0';
-    snprintf(cdatebuf, CARDTYPELEN, "%s", ctime((time_t *)&currfile_atime));
-    cdatebuf[strlen(mdatebuf)-1] = '\0';
-    snprintf(datebuf, MDBUFSIZE, "\t%s\t%s\t%s", mdatebuf,adatebuf,cdatebuf);
-    snprintf(buf+strlen(buf), MAXPATH-strlen(buf), "%s", datebuf);
-  }
+/*
+ * The binary hit log (--binary) starts with BINARY_MAGIC and is a run of
+ * records, each a 32 bit length and then that many bytes: a kind byte
+ * and its fields. Integers are little endian, strings are a length and
+ * the bytes, without a terminator.
+ *
+ *   'F' file    mtime, atime, ctime (64 bits each), path (32 bit length)
+ *   'H' hit     offset (64 bits), track flags (1 = track 1, 2 = track 2),
+ *               type, number (8 bit lengths), owner (16 bit length)
+ *   'S' status  status (8 bit length), path (32 bit length)
+ *
+ * Hits belong to the last file record before them.
+ */
+struct binrec {
+  unsigned char  buf[64 + 2 * 256 + 65536];
+  size_t         len;
+  const char    *path;         /* the path, of any length, goes last */
+};
 
-  if (print_epoch_time) {
-    memset(&datebuf,'\0',MDBUFSIZE);
-    snprintf(datebuf, MDBUFSIZE, "\t%ld\t%ld\t%ld", currfile_mtime,currfile_atime,currfile_ctime);
-    snprintf(buf+strlen(buf), MAXPATH-strlen(buf), "%s", datebuf);
-  }
+static void bin_int(struct binrec *rec, unsigned long long value, int bytes)
+{
+  int i;
 
-  if (tracksrch) {
-    memset(&trackbuf,'\0',MDBUFSIZE);
-    if (tracktype1) {
-      if (track1_srch(cardlen)) {
-        snprintf(trackbuf, MDBUFSIZE, "\tTRACK_1");
-      }
-    }
-    if (tracktype2) {
-      if (track2_srch(cardlen)) {
-        snprintf(trackbuf, MDBUFSIZE, "\tTRACK_2");
-      }
-    }
-    snprintf(buf+strlen(buf), MAXPATH-strlen(buf), "%s", trackbuf);
-  }
+  for (i=0; i<bytes; i++)
+    rec->buf[rec->len++] = (unsigned char)(value >> (8 * i));
+}
 
-  if (logfilefd != NULL) {
-    fprintf(logfilefd, "%s\n", buf);
-  } else {
-    printf("%s\n", buf);
-  }
+static void bin_str(struct binrec *rec, const char *str, int len_bytes)
+{
+  size_t len = str != NULL ? strlen(str) : 0;
 
-  total_count++;
-  file_hit_count++;
+  if (len >= 1UL << (8 * len_bytes))
+    len = (1UL << (8 * len_bytes)) - 1;
+  bin_int(rec, len, len_bytes);
+  memcpy(rec->buf + rec->len, str, len);
+  rec->len += len;
 }
 
-static void check_mastercard_16(long offset)
+static void bin_path(struct binrec *rec, const char *path)
 {
-  char num2buf[7];
-  int  vnum = 0;
+  rec->path = path;
+  bin_int(rec, strlen(path), 4);
+}
 
-  memset(&num2buf, 0, sizeof(num2buf));
-  snprintf(num2buf, 3, "%d%d", cardbuf[0], cardbuf[1]);
-  vnum = atoi(num2buf);
-  if ((vnum > 50) && (vnum < 56))
-    print_result("MASTERCARD", 16, offset);
+static void bin_write(struct binrec *rec)
+{
+  unsigned char len[4];
+  size_t        path = rec->path != NULL ? strlen(rec->path) : 0;
+  size_t        body = rec->len - 4 + path;
 
-  snprintf(num2buf, sizeof(num2buf), "%d%d%d%d%d%d", cardbuf[0], cardbuf[1], cardbuf[2], cardbuf[3], cardbuf[4], cardbuf[5]);
-  vnum = atoi(num2buf);
-  if ((vnum >= 222100) && (vnum <= 272099))
-    print_result("MASTERCARD", 16, offset);
+  len[0] = (unsigned char)body;
+  len[1] = (unsigned char)(body >> 8);
+  len[2] = (unsigned char)(body >> 16);
+  len[3] = (unsigned char)(body >> 24);
+  memcpy(rec->buf, len, 4);
+  fwrite(rec->buf, 1, rec->len, logfilefd);
+  if (path > 0)
+    fwrite(rec->path, 1, path, logfilefd);
 }
 
-static void check_visa_16(long offset)
+static void bin_hit(const char *type, const char *pan, long offset, int track, const char *owner)
 {
-  char  num2buf[2];
-  int   vnum = 0;
+  static struct binrec rec;
 
-  memset(&num2buf, 0, sizeof(num2buf));
-  snprintf(num2buf, 2, "%d", cardbuf[0]);
-  vnum = atoi(num2buf);
-  if (vnum == 4)
-    print_result("VISA", 16, offset);
+  /* a file record before the first hit of each file */
+  if (binary_file_serial != file_count) {
+    binary_file_serial = file_count;
+    rec.len = 4;
+    rec.buf[rec.len++] = 'F';
+    bin_int(&rec, (unsigned long long)currfile_mtime, 8);
+    bin_int(&rec, (unsigned long long)currfile_atime, 8);
+    bin_int(&rec, (unsigned long long)currfile_ctime, 8);
+    bin_path(&rec, currfilename);
+    bin_write(&rec);
+  }
+  rec.len  = 4;
+  rec.path = NULL;
+  rec.buf[rec.len++] = 'H';
+  bin_int(&rec, (unsigned long long)offset, 8);
+  rec.buf[rec.len++] = (unsigned char)track;
+  bin_str(&rec, type, 1);
+  bin_str(&rec, pan, 1);
+  bin_str(&rec, owner, 2);
+  bin_write(&rec);
 }
 
-static void check_discover_16(long offset)
+static void bin_status(const char *file, const char *status)
 {
-  char  num2buf[5];
-  int   vnum = 0;
+  static struct binrec rec;
 
-  memset(&num2buf, 0, sizeof(num2buf));
-  snprintf(num2buf, 5, "%d%d%d%d", cardbuf[0], cardbuf[1], cardbuf[2], cardbuf[3]);
-  vnum = atoi(num2buf);
-  if (vnum == 6011)
-    print_result("DISCOVER", 16, offset);
+  rec.len = 4;
+  rec.buf[rec.len++] = 'S';
+  bin_str(&rec, status, 1);
+  bin_path(&rec, file);
+  bin_write(&rec);
 }
 
-static void check_jcb_16(long offset)
+/*
+ * The lines for a file's triage status or for a file not reached, in
+ * whichever format the output is in.
+ */
+static void print_status(const char *file, const char *status)
 {
-  char  num2buf[5];
-  int   vnum = 0;
+  FILE *out = logfilefd != NULL ? logfilefd : stdout;
 
-  memset(&num2buf, 0, sizeof(num2buf));
-  snprintf(num2buf, 5, "%d%d%d%d", cardbuf[0], cardbuf[1], cardbuf[2], cardbuf[3]);
-  vnum = atoi(num2buf);
-  if ((vnum >= 3528) && (vnum <= 3589))
-    print_result("JCB", 16, offset);
+  if (output_format == FORMAT_BINARY)
+    bin_status(file, status);
+  else if (output_format == FORMAT_JSON)
+    json_status(out, file, status);
+  else if (print_csv)
+    fprintf(out, "%s,%s\n", status, file);
+  else
+    fprintf(out, "%s\t%s\n", file, status);
 }
 
-static void check_amex_15(long offset)
+/*
+ * --max-memory: the buffers and the tables that grow with the scan (the
+ * read and track buffers, batches, the input queue, the aggregate, cache,
+ * owner map and region tables) are allocated through the pool, which
+ * counts them against the budget. An allocation that would go over it
+ * fails, and the caller eases off instead of growing: a batch is scanned
+ * early, the input queue stops reading ahead, the aggregate falls back to
+ * its sketch, the cache stops taking entries.
+ */
+#define HUGE_PAGE (2 * 1024 * 1024)
+
+static struct {
+  size_t  limit;        /* 0 for no limit */
+  size_t  used;
+  size_t  peak;
+  int     huge;         /* --huge-pages */
+} pool;
+
+static int pool_take(size_t n)
 {
-  char  num2buf[3];
-  int   vnum = 0;
+  if (pool.limit != 0 && pool.used + n > pool.limit)
+    return -1;
+  pool.used += n;
+  if (pool.used > pool.peak)
+    pool.peak = pool.used;
+  return 0;
+}
 
-  memset(&num2buf, 0, sizeof(num2buf));
-  snprintf(num2buf, 3, "%d%d", cardbuf[0], cardbuf[1]);
-  vnum = atoi(num2buf);
-  if ((vnum == 34) || (vnum == 37))
-    print_result("AMEX", 15, offset);
+static void pool_give(size_t n)
+{
+  pool.used -= n < pool.used ? n : pool.used;
 }
 
-static void check_enroute_15(long offset)
+/* Past three quarters of the budget, what can wait should. */
+static int pool_tight(void)
 {
-  char  num2buf[5];
-  int   vnum = 0;
+  return pool.limit != 0 && pool.used > pool.limit / 4 * 3;
+}
 
-  memset(&num2buf, 0, sizeof(num2buf));
-  snprintf(num2buf, 5, "%d%d%d%d", cardbuf[0], cardbuf[1], cardbuf[2], cardbuf[3]);
-  vnum = atoi(num2buf);
-  if ((vnum == 2014) || (vnum == 2149))
-    print_result("ENROUTE", 15, offset);
+static void *pool_calloc(size_t count, size_t size)
+{
+  void *ptr;
+
+  if (pool_take(count * size) < 0)
+    return NULL;
+  ptr = calloc(count, size);
+  if (ptr == NULL)
+    pool_give(count * size);
+  return ptr;
 }
 
-static void check_jcb_15(long offset)
+/* realloc() from old to size bytes; on failure ptr is left as it was. */
+static void *pool_resize(void *ptr, size_t old, size_t size)
 {
-  char  num2buf[5];
-  int   vnum = 0;
+  void *tmp;
 
-  memset(&num2buf, 0, sizeof(num2buf));
-  snprintf(num2buf, 5, "%d%d%d%d", cardbuf[0], cardbuf[1], cardbuf[2], cardbuf[3]);
-  vnum = atoi(num2buf);
-  if ((vnum == 2131) || (vnum == 1800) || (vnum == 3528) || (vnum == 3529))
-    print_result("JCB", 15, offset);
+  if (size > old && pool_take(size - old) < 0)
+    return NULL;
+  tmp = realloc(ptr, size);
+  if (tmp == NULL) {
+    if (size > old)
+      pool_give(size - old);
+    return NULL;
+  }
+  if (size < old)
+    pool_give(old - size);
+  return tmp;
 }
 
-static void check_diners_club_cb_14(long offset)
+static void pool_free(void *ptr, size_t size)
 {
-  char  num2buf[4];
-  char  num2buf2[3];
-  int   vnum = 0;
-  int   vnum2 = 0;
+  if (ptr != NULL)
+    pool_give(size);
+  free(ptr);
+}
 
-  memset(&num2buf, 0, sizeof(num2buf));
-  memset(&num2buf2, 0, sizeof(num2buf2));
-  snprintf(num2buf, 4, "%d%d%d", cardbuf[0], cardbuf[1], cardbuf[2]);
-  snprintf(num2buf2, 3, "%d%d", cardbuf[0], cardbuf[1]);
-  vnum = atoi(num2buf);
-  vnum2 = atoi(num2buf2);
-  if (((vnum > 299) && (vnum < 306)) || ((vnum > 379) && (vnum < 389)) || (vnum2 == 36) || 
-      ((vnum2 >= 38) && (vnum2 <=39)))
-    print_result("DINERS_CLUB_CARTE_BLANCHE", 14, offset);
+/*
+ * A buffer kept for the whole run, zeroed. With --huge-pages it is
+ * mapped from huge pages where the system has them to spare, which
+ * rounds it up to a whole 2MB page.
+ */
+static void *pool_buffer(size_t size)
+{
+#if defined(MAP_HUGETLB) && !defined(_WIN32)
+  static int  warned = 0;
+  size_t      huge   = (size + HUGE_PAGE - 1) / HUGE_PAGE * HUGE_PAGE;
+  void       *buf;
+
+  if (pool.huge && (pool.limit == 0 || pool.used + huge <= pool.limit)) {
+    buf = mmap(NULL, huge, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (buf != MAP_FAILED) {
+      pool_take(huge);
+      return buf;
+    }
+    if (!warned++)
+      fprintf(stderr, "pool_buffer: No huge pages to be had, using normal pages; errno=%d\n", errno);
+  }
+#endif
+  return pool_calloc(1, size);
 }
 
-static int process_prefix(int len, long offset)
+/*
+ * --max-memory takes MB, or a number with a K, M or G suffix. Returns 0
+ * if arg isn't one.
+ */
+static size_t parse_memory(const char *arg)
 {
-  switch (len) {
-    case 16:
-      check_mastercard_16(offset);
-      check_visa_16(offset);
-      check_discover_16(offset);
-      check_jcb_16(offset);
+  char               *end;
+  unsigned long long  n = strtoull(arg, &end, 10);
+
+  if (end == arg)
+    return 0;
+  switch (toupper((unsigned char)*end)) {
+    case 'K':
+      n <<= 10;
+      end++;
       break;
-    case 15:
-      check_amex_15(offset);
-      check_enroute_15(offset);
-      check_jcb_15(offset);
+    case 'G':
+      n <<= 30;
+      end++;
       break;
-    case 14:
-      check_diners_club_cb_14(offset);
+    case 'M':
+      end++;
+      /* fall through */
+    default:
+      n <<= 20;
       break;
   }
-  return 0;
+  return *end == '\0' ? (size_t)n : 0;
 }
-static int luhn_check(int len, long offset)
-{
-  int i      = 0;
-  int tmp    = 0;
-  int total  = 0;
-  int nummod = 0;
-  int num[CARDSIZE];
 
-  if (cardbuf[i]<=0)
-    return 0;
+/*
+ * SipHash-2-4, so that the aggregation tables identify a PAN by a keyed
+ * hash instead of keeping the number itself.
+ */
+#define ROTL64(x, b) (((x) << (b)) | ((x) >> (64 - (b))))
+#define SIPROUND \
+  do { \
+    v0 += v1; v1 = ROTL64(v1, 13); v1 ^= v0; v0 = ROTL64(v0, 32); \
+    v2 += v3; v3 = ROTL64(v3, 16); v3 ^= v2; \
+    v0 += v3; v3 = ROTL64(v3, 21); v3 ^= v0; \
+    v2 += v1; v1 = ROTL64(v1, 17); v1 ^= v2; v2 = ROTL64(v2, 32); \
+  } while (0)
 
-  memset(num, 0, CARDSIZE);
+static uint64_t siphash(const unsigned char *in, size_t len, const uint64_t key[2])
+{
+  uint64_t  v0 = 0x736f6d6570736575ULL ^ key[0];
+  uint64_t  v1 = 0x646f72616e646f6dULL ^ key[1];
+  uint64_t  v2 = 0x6c7967656e657261ULL ^ key[0];
+  uint64_t  v3 = 0x7465646279746573ULL ^ key[1];
+  uint64_t  b  = (uint64_t)len << 56;
+  uint64_t  m;
+  size_t    i;
+  size_t    j;
 
-  for (i=0; i<len; i++)
-   num[i]=cardbuf[i];
-
-  for (i=len-2; i>=0; i-=2) {
-    tmp=2*num[i];
-    num[i]=tmp;
-    if (num[i]>9)
-      num[i]-=9;
+  for (i=0; i+8<=len; i+=8) {
+    for (m=0, j=0; j<8; j++)
+      m |= (uint64_t)in[i+j] << (8 * j);
+    v3 ^= m;
+    SIPROUND;
+    SIPROUND;
+    v0 ^= m;
   }
+  for (j=0; i+j<len; j++)
+    b |= (uint64_t)in[i+j] << (8 * j);
+  v3 ^= b;
+  SIPROUND;
+  SIPROUND;
+  v0 ^= b;
+  v2 ^= 0xff;
+  SIPROUND;
+  SIPROUND;
+  SIPROUND;
+  SIPROUND;
+  return v0 ^ v1 ^ v2 ^ v3;
+}
 
-  for (i=0; i<len; i++)
-    total += num[i];
+/*
+ * Keep a file or directory name for the summary. The names are capped
+ * along with the numbers, as a run with few distinct numbers may still
+ * find them in a great many files.
+ */
+static size_t agg_pool_add(const char *str, size_t len)
+{
+  size_t  off   = agg.pool_used;
+  size_t  limit = (size_t)aggregate_max * AGG_NAME_BYTES;
+  size_t  size;
+  void   *tmp;
 
-  nummod = total % 10;
-  if (nummod == 0)
-  {
-#ifdef DEBUG
-  printf("Luhn Check passed ***********************************\n");
-#endif
-    process_prefix(len, offset);
+  if (agg.pool_used + len + 1 > limit)
+    return (size_t)-1;
+  if (agg.pool_used + len + 1 > agg.pool_size) {
+    size = (agg.pool_size + len + 1) * 2;
+    if (size > limit)
+      size = limit;
+    tmp = pool_resize(agg.pool, agg.pool_size, size);
+    if (tmp == NULL)
+      return (size_t)-1;
+    agg.pool      = (char *)tmp;
+    agg.pool_size = size;
   }
-  return nummod;
+  memcpy(agg.pool + off, str, len);
+  agg.pool[off + len] = '\0';
+  agg.pool_used += len + 1;
+  return off;
 }
 
-static int is_ascii_buf(const char *buf, int len)
+/*
+ * Grow an open addressed table to twice its size; slots are found by
+ * linear probing from the low bits of the key, and a zero key is empty.
+ */
+static int agg_grow(void **table, size_t *size, size_t entry, size_t key_offset)
 {
-  int i;
-  for (i=0; i < len; i++) {
-    if (!isascii(buf[i]))
-      return 0;
+  size_t         new_size = *size ? *size * 2 : 1024;
+  unsigned char *old      = (unsigned char *)*table;
+  unsigned char *grown;
+  uint64_t       key;
+  size_t         i;
+  size_t         slot;
+
+  grown = (unsigned char *)pool_calloc(new_size, entry);
+  if (grown == NULL)
+    return -1;
+  for (i=0; i<*size; i++) {
+    memcpy(&key, old + i * entry + key_offset, sizeof key);
+    if (key == 0)
+      continue;
+    for (slot=key & (new_size - 1); ; slot=(slot + 1) & (new_size - 1)) {
+      memcpy(&key, grown + slot * entry + key_offset, sizeof key);
+      if (key == 0)
+        break;
+    }
+    memcpy(grown + slot * entry, old + i * entry, entry);
   }
-  return 1;
+  pool_free(old, *size * entry);
+  *table = grown;
+  *size  = new_size;
+  return 0;
 }
 
-static char *stolower(char *buf)
+static void sketch_add(uint64_t hash)
 {
-  char *ptr = buf;
+  int       idx  = (int)(hash >> (64 - SKETCH_BITS));
+  uint64_t  rest = hash << SKETCH_BITS;
+  int       rank = 1;
 
-  if (buf == NULL || strlen(buf) == 0)
-    return buf;
-
-  while ((*ptr = tolower(*ptr))) ptr++;
-  return buf;
+  while (rank <= 64 - SKETCH_BITS && (rest & (1ULL << 63)) == 0) {
+    rank++;
+    rest <<= 1;
+  }
+  if (rank > agg.sketch[idx])
+    agg.sketch[idx] = (unsigned char)rank;
 }
 
-static void update_status(const char *filename, int position)
+/* HyperLogLog estimate, with the linear counting fix for small sets */
+static double sketch_estimate(void)
 {
-  struct tm *current;
-  time_t     now;
-  char       msgbuffer[MDBUFSIZE];
-  char      *fn;
+  double  m     = 1 << SKETCH_BITS;
+  double  sum   = 0;
+  double  est;
+  int     zeros = 0;
+  int     i;
 
-  /* if ((int)time(NULL) > status_lastupdate) */
-  if (position % (1024 * 1024) == 0 || (int)time(NULL) > status_lastupdate) {
-    printf("%*s\r", status_msglength, " ");
+  for (i=0; i<(1 << SKETCH_BITS); i++) {
+    sum += 1.0 / (double)(1ULL << agg.sketch[i]);
+    if (agg.sketch[i] == 0)
+      zeros++;
+  }
+  est = 0.7213 / (1 + 1.079 / m) * m * m / sum;
+  if (est <= 2.5 * m && zeros > 0)
+    est = m * log(m / zeros);
+  return est;
+}
 
-    time(&now);
-    current = localtime(&now);
+/*
+ * Past --aggregate-max distinct numbers, or when the table can't grow
+ * within --max-memory, fall back to counting them with a sketch in a few
+ * kilobytes; per number details are dropped. The sketch is static, so
+ * that this works however little memory is left.
+ */
+static void agg_to_sketch(void)
+{
+  static unsigned char  sketch[1 << SKETCH_BITS];
+  size_t                i;
 
-    fn = strrchr(filename, '/');
+  agg.sketch = sketch;
+  for (i=0; i<agg.pans_size; i++) {
+    if (agg.pans[i].hash != 0)
+      sketch_add(agg.pans[i].hash);
+  }
+  pool_free(agg.pans, agg.pans_size * sizeof(struct agg_pan));
+  if ((long)agg.pans_used >= aggregate_max)
+    fprintf(stderr, "More than %ld distinct numbers; counting the rest approximately\n", aggregate_max);
+  else
+    fprintf(stderr, "Out of room at %lu distinct numbers; counting the rest approximately\n",
+            (unsigned long)agg.pans_used);
+  agg.pans      = NULL;
+  agg.pans_size = 0;
+}
 
-    if (fn == NULL) {
-      fn = (char *)filename;
-    } else {
-      fn++;
-    }
+/*
+ * The rollup for the directory of a file. A name without a directory is
+ * in the current one, ".", and "/x" is in "/".
+ */
+static struct agg_dir *agg_dir_for(const char *filename)
+{
+  const char     *slash = strrchr(filename, '/');
+  const char     *name  = slash != NULL ? filename : ".";
+  size_t          len   = slash == NULL ? 1 : slash > filename ? (size_t)(slash - filename) : 1;
+  uint64_t        hash  = siphash((const unsigned char *)name, len, agg.key) | 1;
+  struct agg_dir *dir;
+  size_t          slot;
 
-    status_msglength = snprintf(msgbuffer, MDBUFSIZE, "[%02i:%02i:%02i File: %s - Processed: %iMB]\r",
-      current->tm_hour, current->tm_min, current->tm_sec,
-      fn,
-      (position / 1024) / 1024);
+  if (agg.dirs_used * 2 >= agg.dirs_size) {
+    if ((long)agg.dirs_used >= aggregate_max ||
+        agg_grow((void **)&agg.dirs, &agg.dirs_size, sizeof(struct agg_dir),
+                 offsetof(struct agg_dir, hash)) < 0)
+      return NULL;
+  }
+  for (slot=hash & (agg.dirs_size - 1); ; slot=(slot + 1) & (agg.dirs_size - 1)) {
+    dir = &agg.dirs[slot];
+    if (dir->hash == hash)
+      return dir;
+    if (dir->hash == 0)
+      break;
+  }
+  dir->path = agg_pool_add(name, len);
+  if (dir->path == (size_t)-1)
+    return NULL;
+  dir->hash = hash;
+  agg.dirs_used++;
+  return dir;
+}
 
-    printf("%s", msgbuffer);
+/*
+ * A --workers child can't add to the parent's tables, so it writes each
+ * hit to its spool instead, for the parent to aggregate after it.
+ */
+struct agg_rec {
+  char    type[CARDTYPELEN];
+  char    pan[CARDSIZE + 3];
+  long    offset;
+  size_t  name_len;
+};
 
-    fflush(stdout);
+static FILE *agg_spool = NULL;
 
-    status_lastupdate = time(NULL);
-  }
+static void spool_hit(const char *cardname, const char *pan, long offset)
+{
+  struct agg_rec rec;
+
+  memset(&rec, 0, sizeof rec);
+  snprintf(rec.type, sizeof rec.type, "%s", cardname);
+  snprintf(rec.pan, sizeof rec.pan, "%s", pan);
+  rec.offset   = offset;
+  rec.name_len = strlen(currfilename);
+  fwrite(&rec, sizeof rec, 1, agg_spool);
+  fwrite(currfilename, 1, rec.name_len, agg_spool);
 }
 
-static int ccsrch(const char *filename)
+/* Account for one hit in the distinct number table and the rollups. */
+static void aggregate_hit(const char *cardname, const char *pan, long offset)
 {
-  FILE  *in            = NULL;
-  int   cnt            = 0;
-  long  byte_offset    = 1;
-  int   k              = 0;
-  int   counter        = 0;
-  int   total          = 0;
-  int   check          = 0;
-  int   limit_exceeded = 0;
+  struct agg_pan *entry;
+  struct agg_dir *dir;
+  uint64_t        hash = siphash((const unsigned char *)pan, strlen(pan), agg.key) | 1;
+  size_t          len  = strlen(pan);
+  size_t          slot;
+  size_t          i;
 
-#ifdef DEBUG
-  printf("Processing file %s\n",filename);
-#endif
+  /* intern each file's name once, on its first hit; the sketch needs none */
+  if (agg.file_serial != file_count) {
+    agg.file_serial = file_count;
+    agg.file_path   = agg.sketch == NULL ? agg_pool_add(currfilename, strlen(currfilename)) : (size_t)-1;
+    dir             = agg_dir_for(currfilename);
+    agg.file_dir    = dir != NULL ? dir : &agg.other_dirs;
+    agg.file_dir->files++;
+  }
+  agg.file_dir->hits++;
 
-  memset(&lastfilename,'\0',MAXPATH);
-  ccsrch_index = 0;
-  errno        = 0;
-  in = fopen(filename, "rb");
-  if (in == NULL) {
-    if (errno==13) {
-      fprintf(stderr, "ccsrch: Unable to open file %s for reading; Permission Denied\n", filename);
-    } else {
-      fprintf(stderr, "ccsrch: Unable to open file %s for reading; errno=%d\n", filename, errno);
+  /*
+   * No room for the name, so none for more numbers either: an entry
+   * must never point at a name that wasn't kept.
+   */
+  if (agg.sketch == NULL && agg.file_path == (size_t)-1)
+    agg_to_sketch();
+
+  if (agg.sketch != NULL) {
+    sketch_add(hash);
+    return;
+  }
+  if (agg.pans_used * 2 >= agg.pans_size &&
+      agg_grow((void **)&agg.pans, &agg.pans_size, sizeof(struct agg_pan),
+               offsetof(struct agg_pan, hash)) < 0) {
+    agg_to_sketch();
+    sketch_add(hash);
+    return;
+  }
+  for (slot=hash & (agg.pans_size - 1); ; slot=(slot + 1) & (agg.pans_size - 1)) {
+    entry = &agg.pans[slot];
+    if (entry->hash == hash || entry->hash == 0)
+      break;
+  }
+  if (entry->hash == 0) {
+    if ((long)agg.pans_used >= aggregate_max) {
+      agg_to_sketch();
+      sketch_add(hash);
+      return;
     }
-    return -1;
+    /* keep the BIN and the last four digits only */
+    for (i=0; i<len; i++)
+      entry->masked[i] = (i < 6 || i >= len - 4) ? pan[i] : '*';
+    entry->masked[len]  = '\0';
+    entry->hash         = hash;
+    entry->type         = cardname;
+    entry->first_path   = agg.file_path;
+    entry->first_offset = offset;
+    agg.pans_used++;
   }
-  currfilename = filename;
-  byte_offset  = 1;
-  ignore_count = 0;
-  file_count++;
+  entry->count++;
+  entry->last_path   = agg.file_path;
+  entry->last_offset = offset;
+}
 
-  initialize_buffer();
+static int agg_pan_cmp(const void *a, const void *b)
+{
+  const struct agg_pan *x = (const struct agg_pan *)a;
+  const struct agg_pan *y = (const struct agg_pan *)b;
 
-  while (limit_exceeded == 0) {
-    memset(&ccsrch_buf, '\0', BSIZE);
-    cnt = fread(&ccsrch_buf, 1, BSIZE - 1, in);
-    if (cnt <= 0)
-      break;
+  if (x->count != y->count)
+    return x->count > y->count ? -1 : 1;
+  return x->hash < y->hash ? -1 : x->hash > y->hash;
+}
 
-    if (limit_ascii && !is_ascii_buf(ccsrch_buf, cnt))
-      break;
+static int agg_dir_cmp(const void *a, const void *b)
+{
+  const struct agg_dir *x = (const struct agg_dir *)a;
+  const struct agg_dir *y = (const struct agg_dir *)b;
 
-    for (ccsrch_index=0; ccsrch_index<cnt && limit_exceeded==0; ccsrch_index++) {
-      /* check to see if our data is 0...9 (based on ACSII value) */
-      if (isdigit(ccsrch_buf[ccsrch_index])) {
-        check = 1;
-        cardbuf[counter] = ((int)ccsrch_buf[ccsrch_index])-'0';
-        counter++;
-      } else if ((ccsrch_buf[ccsrch_index] == 0) || (ccsrch_buf[ccsrch_index] == '\r') ||
-      	   (ccsrch_buf[ccsrch_index] == '\n') || (ccsrch_buf[ccsrch_index] == '-')) {
-        /*
-         * we consider dashes, nulls, new lines, and carriage
-         * returns to be noise, so ingore those
-         */
-         ignore_count += 1;
-        check = 0;
-      } else {
-        check = 0;
-        initialize_buffer();
-        counter      = 0;
-        ignore_count = 0;
-      }
+  if (x->hits != y->hits)
+    return x->hits > y->hits ? -1 : 1;
+  return strcmp(agg.pool + x->path, agg.pool + y->path);
+}
 
-      if (((counter > 12) && (counter < CARDSIZE)) && (check)) {
-        luhn_check(counter, byte_offset-counter);
-      } else if ((counter == CARDSIZE) && (check)) {
-        for (k=0; k<counter-1; k++) {
-          cardbuf[k] = cardbuf[k + 1];
-        }
-        cardbuf[k] = -1;
-        luhn_check(13,byte_offset-13);
-        luhn_check(14,byte_offset-14);
-        luhn_check(15,byte_offset-15);
-        luhn_check(16,byte_offset-16);
-        counter--;
-      }
-      byte_offset++;
+/* Squeeze the used slots of a table to its front and sort them. */
+static size_t agg_compact(void *table, size_t size, size_t entry, size_t key_offset,
+                          int (*cmp)(const void *, const void *))
+{
+  unsigned char *t    = (unsigned char *)table;
+  uint64_t       key;
+  size_t         used = 0;
+  size_t         i;
+
+  for (i=0; i<size; i++) {
+    memcpy(&key, t + i * entry + key_offset, sizeof key);
+    if (key != 0)
+      memmove(t + used++ * entry, t + i * entry, entry);
+  }
+  qsort(table, used, entry, cmp);
+  return used;
+}
 
-      if (newstatus == 1)
-      	update_status(currfilename, byte_offset);
+/*
+ * The aggregation summary with --json: a header object with the number of
+ * distinct numbers, an object per number unless only the sketch was kept,
+ * then an object per directory.
+ */
+static void print_aggregate_json(FILE *out)
+{
+  struct agg_pan *entry;
+  struct agg_dir *dir;
+  size_t          used;
+  size_t          i;
 
-      /* check to see if we've hit the limit for the current file */
-      if (limit_file_results > 0 && file_hit_count >= limit_file_results)
-    	  limit_exceeded = 1;
+  if (agg.sketch != NULL) {
+    fprintf(out, "{\"distinct\":%.0f,\"estimated\":true}\n", sketch_estimate());
+  } else {
+    used = agg_compact(agg.pans, agg.pans_size, sizeof(struct agg_pan),
+                       offsetof(struct agg_pan, hash), agg_pan_cmp);
+    fprintf(out, "{\"distinct\":%lu,\"estimated\":false}\n", (unsigned long)used);
+    for (i=0; i<used; i++) {
+      entry = &agg.pans[i];
+      fprintf(out, "{\"hash\":\"%016llx\",\"type\":", (unsigned long long)entry->hash);
+      json_string(out, entry->type);
+      fputs(",\"pan\":", out);
+      json_string(out, entry->masked);
+      fprintf(out, ",\"hits\":%ld,\"first_file\":", entry->count);
+      json_string(out, agg.pool + entry->first_path);
+      fprintf(out, ",\"first_offset\":%ld,\"last_file\":", entry->first_offset);
+      json_string(out, agg.pool + entry->last_path);
+      fprintf(out, ",\"last_offset\":%ld}\n", entry->last_offset);
     }
   }
 
-  fclose(in);
-
-  return total;
+  used = agg_compact(agg.dirs, agg.dirs_size, sizeof(struct agg_dir),
+                     offsetof(struct agg_dir, hash), agg_dir_cmp);
+  for (i=0; i<used; i++) {
+    dir = &agg.dirs[i];
+    fputs("{\"directory\":", out);
+    json_string(out, agg.pool + dir->path);
+    fprintf(out, ",\"hits\":%ld,\"files\":%ld}\n", dir->hits, dir->files);
+  }
+  if (agg.other_dirs.hits > 0)
+    fprintf(out, "{\"directory\":null,\"hits\":%ld,\"files\":%ld}\n",
+            agg.other_dirs.hits, agg.other_dirs.files);
 }
 
-static int escape_space(const char *infile, char *outfile)
+/*
+ * Write the aggregation summary to the output: a line per distinct number
+ * (keyed hash, type, masked number, hits, first and last place seen),
+ * then a line per directory with its hits and files with hits.
+ */
+static void print_aggregate(void)
 {
-  int    i       = 0;
-  int    spc     = 0;
-  char   *tmpbuf = NULL;
-  int    filelen = 0;
-  int    newlen  = 0;
-  int    newpos  = 0;
+  FILE           *out = logfilefd != NULL ? logfilefd : stdout;
+  const char     *sep = print_csv ? "," : "\t";
+  struct agg_pan *entry;
+  struct agg_dir *dir;
+  size_t          used;
+  size_t          i;
 
-  filelen = strlen(infile);
-  for (i=0; i<filelen; i++) {
-    if (infile[i] == ' ')
-      spc++;
+  /* the binary log has no record for it; the summary goes to the screen */
+  if (output_format == FORMAT_BINARY)
+    out = stdout;
+  if (output_format == FORMAT_JSON) {
+    print_aggregate_json(out);
+    return;
   }
-
-  newlen = filelen + spc + 1;
-  tmpbuf = (char *)malloc(newlen);
-  if (tmpbuf == NULL) {
-    fprintf(stderr, "escape_space: can't allocate memory; errno=%d\n", errno);
-    return 1;
+  if (agg.sketch != NULL) {
+    fprintf(out, "# distinct card numbers (estimated): %.0f\n", sketch_estimate());
+  } else {
+    used = agg_compact(agg.pans, agg.pans_size, sizeof(struct agg_pan),
+                       offsetof(struct agg_pan, hash), agg_pan_cmp);
+    fprintf(out, "# distinct card numbers: %lu\n", (unsigned long)used);
+    for (i=0; i<used; i++) {
+      entry = &agg.pans[i];
+      fprintf(out, "%016llx%s%s%s%s%s%ld%s%s%s%ld%s%s%s%ld\n",
+              (unsigned long long)entry->hash, sep, entry->type, sep, entry->masked, sep,
+              entry->count, sep, agg.pool + entry->first_path, sep, entry->first_offset,
+              sep, agg.pool + entry->last_path, sep, entry->last_offset);
+    }
   }
-  memset(tmpbuf, '\0', newlen);
 
-  for (i=0; i<filelen; i++) {
-    if (infile[i] == ' ') {
-      tmpbuf[newpos++] = '\\';
-      tmpbuf[newpos] = infile[i];
-    } else {
-      tmpbuf[newpos] = infile[i];
-    }
-    newpos++;
+  used = agg_compact(agg.dirs, agg.dirs_size, sizeof(struct agg_dir),
+                     offsetof(struct agg_dir, hash), agg_dir_cmp);
+  fprintf(out, "# directories: %lu\n", (unsigned long)used);
+  for (i=0; i<used; i++) {
+    dir = &agg.dirs[i];
+    fprintf(out, "%s%s%ld%s%ld\n", agg.pool + dir->path, sep, dir->hits, sep, dir->files);
   }
-  snprintf(outfile, newlen, "%s", tmpbuf);
-  free(tmpbuf);
-  return 0;
+  if (agg.other_dirs.hits > 0)
+    fprintf(out, "(other directories)%s%ld%s%ld\n", sep, agg.other_dirs.hits, sep, agg.other_dirs.files);
 }
 
-static int get_file_stat(const char *inputfile, struct stat *fileattr)
+/*
+ * The key for the hashes: 32 hex digits from --aggregate-key, so that
+ * runs can be compared, or else a random one for this run only.
+ */
+static int set_aggregate_key(const char *hex)
 {
-  int   err     = 0;
-  char *tmp2buf = NULL;
-
-  tmp2buf = strdup(inputfile);
-  if (tmp2buf == NULL) {
-    fprintf(stderr, "get_file_stat: can't allocate memory; errno=%d\n", errno);
-    return 1;
-  }
+  FILE          *in;
+  unsigned char  raw[16];
+  int            i;
+  unsigned int   byte;
 
-  err = stat(tmp2buf, fileattr);
-  if (err != 0) {
-    if (errno == ENOENT) {
-      fprintf(stderr, "get_file_stat: File %s not found, can't get stat info\n", inputfile);
-    } else {
-      fprintf(stderr, "get_file_stat: Cannot stat file %s; errno=%d\n", inputfile, errno);
+  if (hex != NULL) {
+    if (strlen(hex) != 32)
+      return -1;
+    for (i=0; i<16; i++) {
+      if (sscanf(hex + 2 * i, "%2x", &byte) != 1)
+        return -1;
+      raw[i] = (unsigned char)byte;
     }
-    free(tmp2buf);
-    return -1;
+  } else {
+    in = fopen("/dev/urandom", "rb");
+    if (in == NULL || fread(raw, 1, sizeof raw, in) != sizeof raw) {
+      for (i=0; i<16; i++)
+        raw[i] = (unsigned char)(rand() ^ (time(NULL) >> (i % 4 * 8)) ^ getpid());
+    }
+    if (in != NULL)
+      fclose(in);
   }
-  currfile_atime=fileattr->st_atime;
-  currfile_mtime=fileattr->st_mtime;
-  currfile_ctime=fileattr->st_ctime;
-  free(tmp2buf);
+  memcpy(&agg.key[0], raw, 8);
+  memcpy(&agg.key[1], raw + 8, 8);
   return 0;
 }
 
-static char *get_filename_ext(const char *filename)
+static const char *owner_of(long offset)
 {
-  char *slash = strrchr(filename, '/');
-  char *dot   = strrchr(slash, '.');
-  if(!dot || dot == slash)
-    return "";
-  return dot;
+  size_t lo = 0;
+  size_t hi = owner_map.count;
+  size_t mid;
+
+  /* the last extent starting at or before offset */
+  while (hi - lo > 1) {
+    mid = (lo + hi) / 2;
+    if (owner_map.extents[mid].physical <= (unsigned long long)offset)
+      lo = mid;
+    else
+      hi = mid;
+  }
+  if (owner_map.extents[lo].physical <= (unsigned long long)offset &&
+      (unsigned long long)offset < owner_map.extents[lo].physical + owner_map.extents[lo].length)
+    return owner_map.paths + owner_map.extents[lo].path;
+  return "(no file)";
 }
 
-static int is_allowed_file_type(const char *name)
+static void print_result(const char *cardname, int cardlen, long byte_offset)
 {
-  char  delim[] = ",";
-  char *exclude = NULL;
-  char *fname   = NULL;
-  char *result  = NULL;
-  char *ext     = NULL;
-  int   ret     = 0;
+  int		i;
+  char	nbuf[20];
+  char	mdatebuf[CARDTYPELEN];
+  char	adatebuf[CARDTYPELEN];
+  char	cdatebuf[CARDTYPELEN];
+  char	trackbuf[MDBUFSIZE];
+  int   char_before = ccsrch_index - cardlen - ignore_count;
+  int   track       = 0;
+  const char *owner = NULL;
+  FILE *out         = logfilefd != NULL ? logfilefd : stdout;
 
-  if (exclude_extensions == NULL)
-    return 0;
+  /* In a byte range scan, hits starting in the overlap belong to a neighbour */
+  if (!cache_replaying && scan_range_hi >= 0 &&
+      (byte_offset < scan_range_lo || byte_offset >= scan_range_hi))
+    return;
 
-  exclude = strdup(exclude_extensions);
-  fname   = strdup(name);
-  if (exclude == NULL || fname == NULL)
-    return 0;
+  /* If char directly before or after card are a number, don't print */
+  if (!cache_replaying &&
+      ((char_before >= 0 && isdigit(ccsrch_buf[char_before])) ||
+       isdigit(ccsrch_buf[ccsrch_index+1])))
+    return;
 
-  ext     = get_filename_ext(fname);
-  stolower(ext);
-  if (ext != NULL && ext[0] != '\0') {
-    result = strtok(exclude, delim);
-    while (result != NULL) {
-      if (strcmp(result, ext) == 0) {
-        ret = 1;
-        break;
-      } else {
-        result = strtok(NULL, delim);
-      }
+  memset(&nbuf, '\0', sizeof(nbuf));
+
+  for (i=0; i<cardlen; i++)
+    nbuf[i] = cardbuf[i]+'0';
+
+  /* the cache keeps what the content holds, whatever -i is this time */
+  if (cache_recording)
+    cache_note_hit(cardname, nbuf, byte_offset, hit_track(cardlen));
+
+  if (ignore && strstr(ignore, nbuf) != NULL)
+    return;
+
+  /* only the layouts asked for with -t/-T count */
+  if (tracksrch) {
+    track = hit_track(cardlen);
+    if ((track == 1 && !tracktype1) || (track == 2 && !tracktype2))
+      track = 0;
+  }
+
+  if (aggregate_mode) {
+    if (agg_spool != NULL)
+      spool_hit(cardname, nbuf, byte_offset);
+    else
+      aggregate_hit(cardname, nbuf, byte_offset);
+    if (aggregate_only) {
+      total_count++;
+      file_hit_count++;
+      return;
     }
   }
-  free(exclude);
-  free(fname);
-  return ret;
-}
 
-static int proc_dir_list(const char *instr)
-{
-  DIR            *dirptr;
-  struct dirent  *direntptr;
-  int             dir_name_len = 0;
-  char           *curr_path    = NULL;
-  struct stat     fstat;
-  int             err          = 0;
-  char            tmpbuf[BSIZE];
+  /* in triage a confirmed hit is all we want to know about the file */
+  if (triage_mode) {
+    total_count++;
+    file_hit_count++;
+    return;
+  }
 
-  if (instr == NULL)
-    return 1;
+  /* Mask the card if specified */
+  if (mask_card_number)
+    mask_pan(nbuf);
 
-  dir_name_len = strlen(instr);
-  dirptr       = opendir(instr);
+  /* the structured formats have all the fields whatever the options */
+  if (output_format != FORMAT_TEXT) {
+    if (track != 0)
+      trackdatacount++;
+    owner = raw_scanning && owner_map.count > 0 ? owner_of(byte_offset) : NULL;
+    if (output_format == FORMAT_BINARY)
+      bin_hit(cardname, nbuf, byte_offset, track, owner);
+    else
+      json_hit(out, currfilename, cardname, nbuf,
+               byte_offset, currfile_mtime, currfile_atime, currfile_ctime,
+               track == 1 ? "TRACK_1" : track == 2 ? "TRACK_2" : NULL, owner);
+    total_count++;
+    file_hit_count++;
+    return;
+  }
 
-#ifdef DEBUG
-  printf("Checking directory <%s>\n",instr);
-#endif
+  /* MB we need to figure out how to update the count and spit out the final
+  filename with the count.  ensure that it gets flushed out on the last match
+  if you are doing a diff between previous filename and new filename */
 
-  if (dirptr == NULL) {
-    fprintf(stderr, "proc_dir_list: Can't open dir %s; errno=%d\n", instr, errno);
-    return 1;
-  }
-  curr_path = (char *)malloc(MAXPATH + 1);
-  if (curr_path == NULL) {
-    fprintf(stderr, "proc_dir_list: Can't allocate enough space; errno=%d\n", errno);
-    closedir(dirptr);
-    return 1;
+  /* written straight out, so that no name is too long for a buffer */
+  if (print_filename_only) {
+    fputs(currfilename, out);
+  } else if (print_csv) {
+    // currfilename at the end so CSV is easier to repair if a filename has commas
+    fprintf(out, "%s,%s,%s", nbuf, cardname, currfilename);
+  } else {
+    fprintf(out, "%s\t%s\t%s", currfilename, cardname, nbuf);
   }
-  snprintf(curr_path, MAXPATH, "%s", instr);
 
-  while ((direntptr = readdir(dirptr)) != NULL) {
-    /* readdir give us everything and not necessarily in order. This
-       logic is just silly, but it works */
-    if ((strcmp(direntptr->d_name, ".") == 0) ||
-        (strcmp(direntptr->d_name, "..") == 0))
-      continue;
+  /* in process memory the offset is an address */
+  if (print_byte_offset)
+    fprintf(out, mem_scanning ? "\t0x%lx" : "\t%ld", byte_offset);
+  if (print_julian_time) {
+    snprintf(mdatebuf, CARDTYPELEN, "%s", ctime((time_t *)&currfile_mtime));
+    mdatebuf[strlen(mdatebuf)-1] = '\0';
+    snprintf(adatebuf, CARDTYPELEN, "%s", ctime((time_t *)&currfile_atime));
+    adatebuf[strlen(mdatebuf)-1] = '\0';
+    snprintf(cdatebuf, CARDTYPELEN, "%s", ctime((time_t *)&currfile_atime));
+    cdatebuf[strlen(mdatebuf)-1] = '\0';
+    fprintf(out, "\t%s\t%s\t%s", mdatebuf,adatebuf,cdatebuf);
+  }
 
-    snprintf(curr_path+strlen(curr_path), MAXPATH-strlen(curr_path), "%s", direntptr->d_name);
-    err = get_file_stat(curr_path, &fstat);
+  if (print_epoch_time)
+    fprintf(out, "\t%ld\t%ld\t%ld", currfile_mtime,currfile_atime,currfile_ctime);
 
-    if (err == -1) {
-      if (errno == ENOENT) {
-        fprintf(stderr, "proc_dir_list: file %s not found, can't stat\n", curr_path);
-      } else {
-        fprintf(stderr, "proc_dir_list: Cannot stat file %s; errno=%d\n", curr_path, errno);
-      }
-      closedir(dirptr);
-      free(curr_path);
-      return 1;
+  if (tracksrch) {
+    memset(&trackbuf,'\0',MDBUFSIZE);
+    if (track == 1) {
+      snprintf(trackbuf, MDBUFSIZE, "\tTRACK_1");
+      trackdatacount++;
     }
-    if ((fstat.st_mode & S_IFMT) == S_IFDIR) {
-      snprintf(curr_path+strlen(curr_path), MAXPATH-strlen(curr_path), "/");
-      proc_dir_list(curr_path);
-    } else if ((fstat.st_size > 0) && ((fstat.st_mode & S_IFMT) == S_IFREG)) {
-      memset(&tmpbuf, '\0', BSIZE);
-      if (escape_space(curr_path, tmpbuf) == 0) {
-        /* rest file_hit_count so we can keep track of many hits each file has */
-        file_hit_count = 0;
-
-        if (is_allowed_file_type(curr_path) == 0) {
-	        /*
-	         * kludge, need to clean this up
-	         * later else any string matching in the path returns non NULL
-	         */
-	        if (logfilename != NULL) {
-	          if (strstr(curr_path, logfilename) != NULL) {
-	            fprintf(stderr, "We seem to be hitting our log file, so we'll leave this out of the search -> %s\n", curr_path);
-            } else {
-	            ccsrch(curr_path);
-	            if (file_hit_count > 0 && print_file_hit_count == 1)
-	              printf("%s: %d hits\n", curr_path, file_hit_count);
-	          }
-	        } else {
-	          ccsrch(curr_path);
-	        }
-        }
-      }
+    if (track == 2) {
+      snprintf(trackbuf, MDBUFSIZE, "\tTRACK_2");
+      trackdatacount++;
     }
-    curr_path[dir_name_len] = '\0';
+    fputs(trackbuf, out);
   }
 
-  free(curr_path);
+  if (raw_scanning && owner_map.count > 0)
+    fprintf(out, "\t%s", owner_of(byte_offset));
+  putc('\n', out);
+
+  total_count++;
+  file_hit_count++;
+}
+
+static void check_mastercard_16(long offset)
+{
+  char num2buf[7];
+  int  vnum = 0;
+
+  memset(&num2buf, 0, sizeof(num2buf));
+  snprintf(num2buf, 3, "%d%d", cardbuf[0], cardbuf[1]);
+  vnum = atoi(num2buf);
+  if ((vnum > 50) && (vnum < 56))
+    print_result("MASTERCARD", 16, offset);
+
+  snprintf(num2buf, sizeof(num2buf), "%d%d%d%d%d%d", cardbuf[0], cardbuf[1], cardbuf[2], cardbuf[3], cardbuf[4], cardbuf[5]);
+  vnum = atoi(num2buf);
+  if ((vnum >= 222100) && (vnum <= 272099))
+    print_result("MASTERCARD", 16, offset);
+}
+
+static void check_visa_16(long offset)
+{
+  char  num2buf[2];
+  int   vnum = 0;
+
+  memset(&num2buf, 0, sizeof(num2buf));
+  snprintf(num2buf, 2, "%d", cardbuf[0]);
+  vnum = atoi(num2buf);
+  if (vnum == 4)
+    print_result("VISA", 16, offset);
+}
+
+static void check_discover_16(long offset)
+{
+  char  num2buf[5];
+  int   vnum = 0;
+
+  memset(&num2buf, 0, sizeof(num2buf));
+  snprintf(num2buf, 5, "%d%d%d%d", cardbuf[0], cardbuf[1], cardbuf[2], cardbuf[3]);
+  vnum = atoi(num2buf);
+  if (vnum == 6011)
+    print_result("DISCOVER", 16, offset);
+}
+
+static void check_jcb_16(long offset)
+{
+  char  num2buf[5];
+  int   vnum = 0;
+
+  memset(&num2buf, 0, sizeof(num2buf));
+  snprintf(num2buf, 5, "%d%d%d%d", cardbuf[0], cardbuf[1], cardbuf[2], cardbuf[3]);
+  vnum = atoi(num2buf);
+  if ((vnum >= 3528) && (vnum <= 3589))
+    print_result("JCB", 16, offset);
+}
+
+static void check_amex_15(long offset)
+{
+  char  num2buf[3];
+  int   vnum = 0;
+
+  memset(&num2buf, 0, sizeof(num2buf));
+  snprintf(num2buf, 3, "%d%d", cardbuf[0], cardbuf[1]);
+  vnum = atoi(num2buf);
+  if ((vnum == 34) || (vnum == 37))
+    print_result("AMEX", 15, offset);
+}
+
+static void check_enroute_15(long offset)
+{
+  char  num2buf[5];
+  int   vnum = 0;
+
+  memset(&num2buf, 0, sizeof(num2buf));
+  snprintf(num2buf, 5, "%d%d%d%d", cardbuf[0], cardbuf[1], cardbuf[2], cardbuf[3]);
+  vnum = atoi(num2buf);
+  if ((vnum == 2014) || (vnum == 2149))
+    print_result("ENROUTE", 15, offset);
+}
+
+static void check_jcb_15(long offset)
+{
+  char  num2buf[5];
+  int   vnum = 0;
+
+  memset(&num2buf, 0, sizeof(num2buf));
+  snprintf(num2buf, 5, "%d%d%d%d", cardbuf[0], cardbuf[1], cardbuf[2], cardbuf[3]);
+  vnum = atoi(num2buf);
+  if ((vnum == 2131) || (vnum == 1800) || (vnum == 3528) || (vnum == 3529))
+    print_result("JCB", 15, offset);
+}
+
+static void check_diners_club_cb_14(long offset)
+{
+  char  num2buf[4];
+  char  num2buf2[3];
+  int   vnum = 0;
+  int   vnum2 = 0;
+
+  memset(&num2buf, 0, sizeof(num2buf));
+  memset(&num2buf2, 0, sizeof(num2buf2));
+  snprintf(num2buf, 4, "%d%d%d", cardbuf[0], cardbuf[1], cardbuf[2]);
+  snprintf(num2buf2, 3, "%d%d", cardbuf[0], cardbuf[1]);
+  vnum = atoi(num2buf);
+  vnum2 = atoi(num2buf2);
+  if (((vnum > 299) && (vnum < 306)) || ((vnum > 379) && (vnum < 389)) || (vnum2 == 36) || 
+      ((vnum2 >= 38) && (vnum2 <=39)))
+    print_result("DINERS_CLUB_CARTE_BLANCHE", 14, offset);
+}
+
+static int process_prefix(int len, long offset)
+{
+  switch (len) {
+    case 16:
+      check_mastercard_16(offset);
+      check_visa_16(offset);
+      check_discover_16(offset);
+      check_jcb_16(offset);
+      break;
+    case 15:
+      check_amex_15(offset);
+      check_enroute_15(offset);
+      check_jcb_15(offset);
+      break;
+    case 14:
+      check_diners_club_cb_14(offset);
+      break;
+  }
+  return 0;
+}
+static int luhn_check(int len, long offset)
+{
+  int i      = 0;
+  int tmp    = 0;
+  int total  = 0;
+  int nummod = 0;
+  int num[CARDSIZE];
+
+  if (cardbuf[i]<=0)
+    return 0;
+
+  memset(num, 0, CARDSIZE);
+
+  for (i=0; i<len; i++)
+   num[i]=cardbuf[i];
+
+  for (i=len-2; i>=0; i-=2) {
+    tmp=2*num[i];
+    num[i]=tmp;
+    if (num[i]>9)
+      num[i]-=9;
+  }
+
+  for (i=0; i<len; i++)
+    total += num[i];
+
+  nummod = total % 10;
+  if (nummod == 0)
+  {
+#ifdef DEBUG
+  printf("Luhn Check passed ***********************************\n");
+#endif
+    process_prefix(len, offset);
+  }
+  return nummod;
+}
+
+static int is_ascii_buf(const char *buf, int len)
+{
+  int i;
+  for (i=0; i < len; i++) {
+    if (!isascii(buf[i]))
+      return 0;
+  }
+  return 1;
+}
+
+static char *stolower(char *buf)
+{
+  char *ptr = buf;
+
+  if (buf == NULL || strlen(buf) == 0)
+    return buf;
+
+  while ((*ptr = tolower(*ptr))) ptr++;
+  return buf;
+}
+
+static void update_status(const char *filename, int position)
+{
+  struct tm *current;
+  time_t     now;
+  char       msgbuffer[MDBUFSIZE];
+  char      *fn;
+
+  /* if ((int)time(NULL) > status_lastupdate) */
+  if (position % (1024 * 1024) == 0 || (int)time(NULL) > status_lastupdate) {
+    printf("%*s\r", status_msglength, " ");
+
+    time(&now);
+    current = localtime(&now);
+
+    fn = strrchr(filename, '/');
+
+    if (fn == NULL) {
+      fn = (char *)filename;
+    } else {
+      fn++;
+    }
+
+    status_msglength = snprintf(msgbuffer, MDBUFSIZE, "[%02i:%02i:%02i File: %s - Processed: %iMB]\r",
+      current->tm_hour, current->tm_min, current->tm_sec,
+      fn,
+      (position / 1024) / 1024);
+
+    printf("%s", msgbuffer);
+
+    fflush(stdout);
+
+    status_lastupdate = time(NULL);
+  }
+}
+
+/*
+ * Run the card number checks over ccsrch_buf[0..cnt), carrying the digit
+ * run and offset over from the previous chunk. Returns 1 once the -l
+ * limit for the current file is reached.
+ */
+static int scan_chunk(int cnt)
+{
+  int k     = 0;
+  int check = 0;
+
+  for (ccsrch_index=0; ccsrch_index<cnt; ccsrch_index++) {
+    /* check to see if our data is 0...9 (based on ACSII value) */
+    if (isdigit(ccsrch_buf[ccsrch_index])) {
+      check = 1;
+      cardbuf[scan_counter] = ((int)ccsrch_buf[ccsrch_index])-'0';
+      scan_counter++;
+    } else if ((ccsrch_buf[ccsrch_index] == 0) || (ccsrch_buf[ccsrch_index] == '\r') ||
+    	   (ccsrch_buf[ccsrch_index] == '\n') || (ccsrch_buf[ccsrch_index] == '-')) {
+      /*
+       * we consider dashes, nulls, new lines, and carriage
+       * returns to be noise, so ingore those
+       */
+       ignore_count += 1;
+      check = 0;
+    } else {
+      check = 0;
+      initialize_buffer();
+      scan_counter = 0;
+      ignore_count = 0;
+    }
+
+    if (((scan_counter > 12) && (scan_counter < CARDSIZE)) && (check)) {
+      luhn_check(scan_counter, scan_offset-scan_counter);
+    } else if ((scan_counter == CARDSIZE) && (check)) {
+      for (k=0; k<scan_counter-1; k++) {
+        cardbuf[k] = cardbuf[k + 1];
+      }
+      cardbuf[k] = -1;
+      luhn_check(13,scan_offset-13);
+      luhn_check(14,scan_offset-14);
+      luhn_check(15,scan_offset-15);
+      luhn_check(16,scan_offset-16);
+      scan_counter--;
+    }
+    scan_offset++;
+
+    if (newstatus == 1)
+    	update_status(currfilename, scan_offset);
+
+    /* check to see if we've hit the limit for the current file */
+    if (limit_file_results > 0 && file_hit_count >= limit_file_results)
+  	  return 1;
+    if (triage_mode && file_hit_count > 0)
+      return 1;
+  }
+  return 0;
+}
+
+/*
+ * --track-only: instead of looking at every digit, jump from one field
+ * separator to the next with memchr() ('^' for track 1, '=' for track 2)
+ * and check the whole layout around it:
+ *
+ *   track 1   [%]B<PAN>^<NAME>^<YYMM><service code>...
+ *   track 2   [;]<PAN>=<YYMM><service code>...
+ *
+ * The data goes through a window that keeps the tail of the last read,
+ * so a track split across two reads is still seen whole. A separator is
+ * looked at once TRACK_AFTER bytes after it are in, or at the end.
+ */
+#define TRACK_PAN_MIN 14        /* the PAN lengths there are card types for */
+#define TRACK_PAN_MAX (CARDSIZE - 1)
+#define TRACK_BEFORE  24        /* sentinel, format code and the PAN */
+#define TRACK_AFTER   40        /* name, separator, expiry, service code */
+
+static struct {
+  char  *buf;
+  long   len;
+  long   base;                  /* file offset of buf[0] */
+  long   done;                  /* separators before this offset are done */
+} twin;
+
+static int track_digits_before(long i)
+{
+  int k = 0;
+
+  while (i - k - 1 >= 0 && k <= TRACK_PAN_MAX && isdigit((unsigned char)twin.buf[i - k - 1]))
+    k++;
+  return k;
+}
+
+/* YYMM and a service code, whose first digit is an interchange rule */
+static int track_expiry_ok(long i)
+{
+  const char *p  = twin.buf + i;
+  int         mm;
+
+  if (i + 7 > twin.len)
+    return 0;
+  for (mm=0; mm<7; mm++) {
+    if (!isdigit((unsigned char)p[mm]))
+      return 0;
+  }
+  mm = (p[2] - '0') * 10 + (p[3] - '0');
+  return mm >= 1 && mm <= 12 && strchr("125679", p[4]) != NULL;
+}
+
+static int track1_at(long i)
+{
+  int   k = track_digits_before(i);
+  long  j;
+
+  if (k < TRACK_PAN_MIN || k > TRACK_PAN_MAX || i - k - 1 < 0 || twin.buf[i - k - 1] != 'B')
+    return 0;
+  /* the name: 2 to 26 characters of the track 1 set, starting with a letter */
+  if (twin.buf[i + 1] < 'A' || twin.buf[i + 1] > 'Z')
+    return 0;
+  for (j=i+1; j<twin.len && j<=i+27 && twin.buf[j] != '^'; j++) {
+    if (twin.buf[j] < ' ' || twin.buf[j] > '_' || twin.buf[j] == '%')
+      return 0;
+  }
+  if (j >= twin.len || twin.buf[j] != '^' || j - i - 1 < 2)
+    return 0;
+  return track_expiry_ok(j + 1) ? k : 0;
+}
+
+static int track2_at(long i)
+{
+  int   k = track_digits_before(i);
+  char  c;
+
+  if (k < TRACK_PAN_MIN || k > TRACK_PAN_MAX)
+    return 0;
+  c = i - k - 1 >= 0 ? twin.buf[i - k - 1] : ';';
+  if (c != ';' && isalnum((unsigned char)c))
+    return 0;
+  return track_expiry_ok(i + 1) ? k : 0;
+}
+
+/* A layout that checks out goes through the usual Luhn and prefix checks. */
+static void track_found(long i, int k)
+{
+  int j;
+
+  for (j=0; j<k; j++)
+    cardbuf[j] = twin.buf[i - k + j] - '0';
+  cardbuf[k]   = -1;
+  ccsrch_buf   = twin.buf;
+  ccsrch_index = i - 1;
+  ignore_count = 0;
+  luhn_check(k, twin.base + i - k);
+}
+
+/* Feed n bytes of data through the window; NULL at the end of the data. */
+static int track_feed(const char *data, int n)
+{
+  long        keep = twin.len < TRACK_BEFORE + TRACK_AFTER ? twin.len : TRACK_BEFORE + TRACK_AFTER;
+  long        end;
+  long        i;
+  const char *caret = NULL;
+  const char *equal = NULL;
+  const char *hit;
+
+  if (twin.buf == NULL) {
+    twin.buf = (char *)pool_buffer(IOBUFSIZE + TRACK_BEFORE + TRACK_AFTER + IOPAD);
+    if (twin.buf == NULL) {
+      fprintf(stderr, "track_feed: can't allocate memory; errno=%d\n", errno);
+      return 1;
+    }
+  }
+  memmove(twin.buf, twin.buf + twin.len - keep, keep);
+  twin.base += twin.len - keep;
+  twin.len   = keep;
+  if (data != NULL) {
+    memcpy(twin.buf + twin.len, data, n);
+    twin.len    += n;
+    scan_offset += n;
+  }
+  memset(twin.buf + twin.len, '\0', IOPAD);
+
+  end = data != NULL ? twin.len - TRACK_AFTER : twin.len;
+  i   = twin.done - twin.base;
+  while (i < end) {
+    /* look for each separator again only once we are past the last one;
+       one that isn't there is taken to be at the end */
+    if (caret == NULL || caret < twin.buf + i) {
+      caret = tracktype1 ? memchr(twin.buf + i, '^', end - i) : NULL;
+      if (caret == NULL)
+        caret = twin.buf + end;
+    }
+    if (equal == NULL || equal < twin.buf + i) {
+      equal = tracktype2 ? memchr(twin.buf + i, '=', end - i) : NULL;
+      if (equal == NULL)
+        equal = twin.buf + end;
+    }
+    hit = caret < equal ? caret : equal;
+    if (hit >= twin.buf + end)
+      break;
+    i   = hit - twin.buf;
+    if (*hit == '^' && (n = track1_at(i)) > 0)
+      track_found(i, n);
+    else if (*hit == '=' && (n = track2_at(i)) > 0)
+      track_found(i, n);
+    i++;
+
+    if (limit_file_results > 0 && file_hit_count >= limit_file_results)
+      return 1;
+    if (triage_mode && file_hit_count > 0)
+      return 1;
+  }
+  if (end > twin.done - twin.base)
+    twin.done = twin.base + end;
+  if (newstatus == 1)
+    update_status(currfilename, scan_offset);
+  return 0;
+}
+
+static double now_seconds(void)
+{
+#ifdef CLOCK_MONOTONIC
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+#else
+  return (double)time(NULL);
+#endif
+}
+
+static void sleep_seconds(double secs)
+{
+#ifdef _WIN32
+  Sleep((DWORD)(secs * 1000));
+#else
+  struct timespec ts;
+
+  ts.tv_sec  = (time_t)secs;
+  ts.tv_nsec = (long)((secs - ts.tv_sec) * 1e9);
+  /* a signal cuts the nap short so the scan can stop promptly */
+  nanosleep(&ts, NULL);
+#endif
+}
+
+static void bucket_init(struct token_bucket *b, double rate)
+{
+  b->rate   = rate;
+  b->tokens = rate;
+  b->last   = now_seconds();
+}
+
+static void bucket_take(struct token_bucket *b, double n)
+{
+  double now;
+
+  if (b->rate <= 0)
+    return;
+  now        = now_seconds();
+  b->tokens += (now - b->last) * b->rate;
+  b->last    = now;
+  if (b->tokens > b->rate)
+    b->tokens = b->rate;
+  b->tokens -= n;
+  if (b->tokens < 0 && !stop_scan)
+    sleep_seconds(-b->tokens / b->rate);
+}
+
+/*
+ * Adaptive mode: a read slower than --adaptive-ms suggests the disk is
+ * busy with real work, so halve the share of time spent reading; fast
+ * reads win it back a little at a time. The share is enforced by
+ * sleeping in proportion to the time each read took.
+ */
+static void adapt_to_latency(double elapsed)
+{
+  if (adaptive_latency <= 0)
+    return;
+  if (elapsed * 1000 > adaptive_latency) {
+    duty_cycle /= 2;
+    if (duty_cycle < 1.0 / 64)
+      duty_cycle = 1.0 / 64;
+  } else if (duty_cycle < 1) {
+    duty_cycle += 1.0 / 16;
+    if (duty_cycle > 1)
+      duty_cycle = 1;
+  }
+  if (duty_cycle < 1 && !stop_scan)
+    sleep_seconds(elapsed * (1 / duty_cycle - 1));
+}
+
+/* Once the deadline passes, scanning stops but the walk carries on listing. */
+static int check_deadline(void)
+{
+  if (deadline != 0 && !deadline_passed && time(NULL) >= deadline) {
+    deadline_passed = 1;
+    printf("\nDeadline reached; listing the files not scanned\n");
+  }
+  return deadline_passed;
+}
+
+/* Lower our CPU and I/O priority as asked; failures are only warnings. */
+static void lower_priority(void)
+{
+#ifndef _WIN32
+  if (nice_level != 0) {
+    errno = 0;
+    if (nice(nice_level) == -1 && errno != 0)
+      fprintf(stderr, "Unable to change nice level; errno=%d\n", errno);
+  }
+#endif
+  if (idle_io) {
+#if defined(__linux__) && defined(SYS_ioprio_set)
+    if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT) != 0)
+      fprintf(stderr, "Unable to set idle I/O priority; errno=%d\n", errno);
+#else
+    fprintf(stderr, "Idle I/O priority is not supported on this platform\n");
+#endif
+  }
+}
+
+#ifdef AT_FDCWD
+/*
+ * A path too long for the kernel (ENAMETOOLONG) is taken one directory
+ * at a time. Returns the directory holding the last component, which
+ * *name is set to, or -1.
+ */
+static int long_path_dir(const char *path, const char **name)
+{
+  char        part[1024];
+  const char *p = path;
+  const char *slash;
+  size_t      len;
+  int         dfd;
+  int         next;
+
+  dfd = open(*path == '/' ? "/" : ".", O_RDONLY | O_DIRECTORY);
+  while (dfd >= 0 && (slash = strchr(p, '/')) != NULL) {
+    len = slash - p;
+    if (len >= sizeof part) {
+      close(dfd);
+      errno = ENAMETOOLONG;
+      return -1;
+    }
+    if (len > 0) {
+      memcpy(part, p, len);
+      part[len] = '\0';
+      next = openat(dfd, part, O_RDONLY | O_DIRECTORY);
+      close(dfd);
+      dfd = next;
+    }
+    p = slash + 1;
+  }
+  *name = p;
+  return dfd;
+}
+
+static int open_long(const char *path, int flags)
+{
+  const char *name;
+  int         dfd = long_path_dir(path, &name);
+  int         fd;
+  int         err;
+
+  if (dfd < 0)
+    return -1;
+  fd  = openat(dfd, name, flags);
+  err = errno;
+  close(dfd);
+  errno = err;
+  return fd;
+}
+
+static int stat_long(const char *path, struct stat *fileattr)
+{
+  const char *name;
+  int         dfd = long_path_dir(path, &name);
+  int         ret;
+  int         err;
+
+  if (dfd < 0)
+    return -1;
+  ret = fstatat(dfd, name, fileattr, 0);
+  err = errno;
+  close(dfd);
+  errno = err;
+  return ret;
+}
+#endif
+
+/*
+ * Open a file for scanning. In gentle mode try not to touch its atime,
+ * which only the owner (or root) may ask for.
+ */
+static int open_path(const char *filename, int flags)
+{
+#ifdef AT_FDCWD
+  int fd;
+
+  /* in the walk, relative to the directory, which has no length limit */
+  if (walk_name != NULL)
+    return openat(walk_dir_fd, walk_name, flags);
+  /* elsewhere (batches, -F, plans) by the full path, or bit by bit */
+  fd = open(filename, flags);
+  if (fd < 0 && errno == ENAMETOOLONG)
+    fd = open_long(filename, flags);
+  return fd;
+#else
+  return open(filename, flags);
+#endif
+}
+
+static int open_scan_file(const char *filename)
+{
+  int fd = -1;
+
+  bucket_take(&open_bucket, 1);
+
+#ifdef O_NOATIME
+  if (gentle_io) {
+    fd = open_path(filename, O_RDONLY | O_BINARY | O_NOATIME);
+    if (fd >= 0 || errno != EPERM)
+      return fd;
+  }
+#endif
+  fd = open_path(filename, O_RDONLY | O_BINARY);
+  return fd;
+}
+
+/*
+ * --prefetch: ask for the head of a file that will be scanned soon, so
+ * the disk works on it while the current file is scanned. The open also
+ * brings its inode in; the pages stay cached after the close. These
+ * opens count against --rate-opens like any other.
+ */
+static void prefetch_file(const char *filename)
+{
+  int fd;
+
+  if (prefetch_window <= 0)
+    return;
+  fd = open_scan_file(filename);
+  if (fd < 0)
+    return;
+#ifdef POSIX_FADV_WILLNEED
+  posix_fadvise(fd, 0, PREFETCH_BYTES, POSIX_FADV_WILLNEED);
+#endif
+  close(fd);
+}
+
+/*
+ * Large files can bypass the page cache altogether with --direct. This
+ * needs aligned offsets, lengths and buffers, and not every filesystem
+ * supports it, so a refusal just leaves the file on buffered reads.
+ */
+static int try_direct_io(int fd, long size)
+{
+#ifdef O_DIRECT
+  struct stat fileattr;
+  int         flags;
+
+  if (size < 0 && fstat(fd, &fileattr) == 0)
+    size = fileattr.st_size;
+  if (!direct_io || size < DIRECT_MIN)
+    return 0;
+  flags = fcntl(fd, F_GETFL);
+  if (flags < 0 || fcntl(fd, F_SETFL, flags | O_DIRECT) != 0)
+    return 0;
+  return 1;
+#else
+  (void)fd;
+  (void)size;
+  return 0;
+#endif
+}
+
+/* SHA-256 (FIPS 180-4), for the result cache */
+struct sha256 {
+  uint32_t            h[8];
+  unsigned char       block[64];
+  size_t              fill;
+  unsigned long long  total;
+};
+
+static const uint32_t sha256_k[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROTR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256_block(struct sha256 *ctx, const unsigned char *p)
+{
+  uint32_t  w[64];
+  uint32_t  a, b, c, d, e, f, g, h, t1, t2;
+  int       i;
+
+  for (i=0; i<16; i++)
+    w[i] = (uint32_t)p[4*i] << 24 | (uint32_t)p[4*i+1] << 16 | (uint32_t)p[4*i+2] << 8 | p[4*i+3];
+  for (i=16; i<64; i++)
+    w[i] = (ROTR32(w[i-2], 17) ^ ROTR32(w[i-2], 19) ^ (w[i-2] >> 10)) + w[i-7] +
+           (ROTR32(w[i-15], 7) ^ ROTR32(w[i-15], 18) ^ (w[i-15] >> 3)) + w[i-16];
+
+  a = ctx->h[0]; b = ctx->h[1]; c = ctx->h[2]; d = ctx->h[3];
+  e = ctx->h[4]; f = ctx->h[5]; g = ctx->h[6]; h = ctx->h[7];
+  for (i=0; i<64; i++) {
+    t1 = h + (ROTR32(e, 6) ^ ROTR32(e, 11) ^ ROTR32(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+    t2 = (ROTR32(a, 2) ^ ROTR32(a, 13) ^ ROTR32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+    h = g; g = f; f = e; e = d + t1;
+    d = c; c = b; b = a; a = t1 + t2;
+  }
+  ctx->h[0] += a; ctx->h[1] += b; ctx->h[2] += c; ctx->h[3] += d;
+  ctx->h[4] += e; ctx->h[5] += f; ctx->h[6] += g; ctx->h[7] += h;
+}
+
+static void sha256_init(struct sha256 *ctx)
+{
+  static const uint32_t iv[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+  };
+
+  memcpy(ctx->h, iv, sizeof iv);
+  ctx->fill  = 0;
+  ctx->total = 0;
+}
+
+static void sha256_update(struct sha256 *ctx, const void *data, size_t len)
+{
+  const unsigned char *p = (const unsigned char *)data;
+  size_t               n;
+
+  ctx->total += len;
+  if (ctx->fill > 0) {
+    n = 64 - ctx->fill < len ? 64 - ctx->fill : len;
+    memcpy(ctx->block + ctx->fill, p, n);
+    ctx->fill += n;
+    p         += n;
+    len       -= n;
+    if (ctx->fill < 64)
+      return;
+    sha256_block(ctx, ctx->block);
+    ctx->fill = 0;
+  }
+  for (; len >= 64; p += 64, len -= 64)
+    sha256_block(ctx, p);
+  memcpy(ctx->block, p, len);
+  ctx->fill = len;
+}
+
+static void sha256_final(struct sha256 *ctx, unsigned char digest[32])
+{
+  unsigned long long  bits = ctx->total * 8;
+  unsigned char       pad[72];
+  size_t              padlen;
+  int                 i;
+
+  padlen = (ctx->fill < 56 ? 56 : 120) - ctx->fill;
+  memset(pad, 0, sizeof pad);
+  pad[0] = 0x80;
+  for (i=0; i<8; i++)
+    pad[padlen + i] = (unsigned char)(bits >> (56 - 8 * i));
+  sha256_update(ctx, pad, padlen + 8);
+  for (i=0; i<32; i++)
+    digest[i] = (unsigned char)(ctx->h[i / 4] >> (24 - 8 * (i % 4)));
+}
+
+/*
+ * --cache: what scanning a file found, keyed by the SHA-256 of its
+ * content, so that a byte-identical file (a system file on the next VM
+ * built from the same image) is only hashed, not scanned. The cache file
+ * is a log of lines
+ *
+ *   <sha256> <sample hash> <size> <mode> <hits> [<offset>,<type>,<pan>,<track> ...]
+ *
+ * each written with a single O_APPEND write(), so concurrent runs can
+ * share one file, and caches merge by concatenation; duplicates and a
+ * torn last line are skipped on loading. The sample hash covers the size
+ * and three 64KB samples: a file whose sample hash is in no entry can't
+ * be in the cache, so it is scanned without a full hashing pass first.
+ * mode is the options that change what a scan finds.
+ */
+#define CACHE_SAMPLE  (64 * 1024)
+#define CACHE_MAX_HITS 1000
+
+struct cache_entry {
+  unsigned char  sha[32];
+  unsigned char  sample[16];
+  long           size;
+  int            mode;
+  size_t         hits;         /* offset of the hit list in cache.pool */
+};
+
+static struct {
+  struct cache_entry  *entries;
+  size_t               count;
+  size_t               size;
+  size_t              *index;        /* entry + 1 by sample hash, 0 if free */
+  size_t               index_size;
+  char                *pool;
+  size_t               pool_used;
+  size_t               pool_size;
+  int                  out;          /* the cache file, for appending */
+  int                  full;         /* no room to add entries */
+  struct sha256        ctx;          /* content hash kept during a scan */
+  int                  hashing;
+  int                  sha_known;
+  unsigned char        sha[32];
+  unsigned char        sample[16];
+  char                *line;         /* the record being built */
+  size_t               line_used;
+  size_t               line_size;
+  long                 line_hits;
+} cache;
+
+static const char *const card_names[] = {
+  "MASTERCARD", "VISA", "DISCOVER", "JCB", "AMEX", "ENROUTE", "DINERS_CLUB_CARTE_BLANCHE", NULL
+};
+
+static int cache_mode(void)
+{
+  return limit_ascii | track_mode << 1 | (track_mode ? tracktype1 << 2 | tracktype2 << 3 : 0);
+}
+
+static uint64_t cache_key(const unsigned char *sample, long size, int mode)
+{
+  uint64_t key = 0;
+
+  memcpy(&key, sample, sizeof key);
+  return (key ^ (uint64_t)size * 0x9e3779b97f4a7c15ULL ^ (uint64_t)mode) | 1;
+}
+
+static void cache_hex(char *out, const unsigned char *bytes, int len)
+{
+  static const char digits[] = "0123456789abcdef";
+  int               i;
+
+  for (i=0; i<len; i++) {
+    out[2*i]   = digits[bytes[i] >> 4];
+    out[2*i+1] = digits[bytes[i] & 15];
+  }
+  out[2*len] = '\0';
+}
+
+static int cache_unhex(unsigned char *bytes, const char *in, int len)
+{
+  unsigned int byte;
+  int          i;
+
+  for (i=0; i<len; i++) {
+    if (!isxdigit((unsigned char)in[2*i]) || !isxdigit((unsigned char)in[2*i+1]) ||
+        sscanf(in + 2 * i, "%2x", &byte) != 1)
+      return -1;
+    bytes[i] = (unsigned char)byte;
+  }
+  return in[2*len] == ' ' ? 0 : -1;
+}
+
+/*
+ * The entry with this content (and mode), or with sha NULL the first
+ * one with this sample hash. Returns -1 if there is none.
+ */
+static long cache_find(const unsigned char *sample, long size, int mode, const unsigned char *sha)
+{
+  struct cache_entry *entry;
+  size_t              slot;
+
+  if (cache.index_size == 0)
+    return -1;
+  for (slot=cache_key(sample, size, mode) & (cache.index_size - 1); cache.index[slot] != 0;
+       slot=(slot + 1) & (cache.index_size - 1)) {
+    entry = &cache.entries[cache.index[slot] - 1];
+    if (entry->size == size && entry->mode == mode &&
+        memcmp(entry->sample, sample, sizeof entry->sample) == 0 &&
+        (sha == NULL || memcmp(entry->sha, sha, sizeof entry->sha) == 0))
+      return (long)(cache.index[slot] - 1);
+  }
+  return -1;
+}
+
+/* Add an entry from a cache line; hits is the text after the hit count. */
+static int cache_add(const unsigned char *sha, const unsigned char *sample, long size, int mode,
+                     const char *hits)
+{
+  struct cache_entry *entry;
+  size_t              len = strlen(hits) + 1;
+  size_t              slot;
+  size_t              i;
+  void               *tmp;
+
+  if (cache_find(sample, size, mode, sha) >= 0)
+    return 0;
+  if (cache.count == cache.size) {
+    tmp = pool_resize(cache.entries, cache.size * sizeof(struct cache_entry),
+                      (cache.size * 2 + 1024) * sizeof(struct cache_entry));
+    if (tmp == NULL)
+      return -1;
+    cache.entries = (struct cache_entry *)tmp;
+    cache.size    = cache.size * 2 + 1024;
+  }
+  if (cache.pool_used + len > cache.pool_size) {
+    tmp = pool_resize(cache.pool, cache.pool_size, (cache.pool_size + len) * 2);
+    if (tmp == NULL)
+      return -1;
+    cache.pool      = (char *)tmp;
+    cache.pool_size = (cache.pool_size + len) * 2;
+  }
+  /* keep the index at most half full */
+  if ((cache.count + 1) * 2 > cache.index_size) {
+    tmp = pool_calloc(cache.index_size ? cache.index_size * 2 : 4096, sizeof(size_t));
+    if (tmp == NULL)
+      return -1;
+    pool_free(cache.index, cache.index_size * sizeof(size_t));
+    cache.index      = (size_t *)tmp;
+    cache.index_size = cache.index_size ? cache.index_size * 2 : 4096;
+    for (i=0; i<cache.count; i++) {
+      entry = &cache.entries[i];
+      for (slot=cache_key(entry->sample, entry->size, entry->mode) & (cache.index_size - 1);
+           cache.index[slot] != 0; slot=(slot + 1) & (cache.index_size - 1))
+        ;
+      cache.index[slot] = i + 1;
+    }
+  }
+
+  entry = &cache.entries[cache.count];
+  memcpy(entry->sha, sha, sizeof entry->sha);
+  memcpy(entry->sample, sample, sizeof entry->sample);
+  entry->size = size;
+  entry->mode = mode;
+  entry->hits = cache.pool_used;
+  memcpy(cache.pool + cache.pool_used, hits, len);
+  cache.pool_used += len;
+  for (slot=cache_key(sample, size, mode) & (cache.index_size - 1); cache.index[slot] != 0;
+       slot=(slot + 1) & (cache.index_size - 1))
+    ;
+  cache.index[slot] = ++cache.count;
+  return 0;
+}
+
+static int cache_parse(char *line)
+{
+  unsigned char  sha[32];
+  unsigned char  sample[16];
+  long           size;
+  int            mode;
+  long           hits;
+  int            used = 0;
+
+  if (cache_unhex(sha, line, 32) < 0 || cache_unhex(sample, line + 65, 16) < 0)
+    return -1;
+  if (sscanf(line + 98, "%ld %d %ld%n", &size, &mode, &hits, &used) != 3)
+    return -1;
+  return cache_add(sha, sample, size, mode, line + 98 + used);
+}
+
+/*
+ * Load the cache file, if there is one yet, and open it for appending.
+ * Lines that don't parse (the header, a line cut short) are passed over.
+ */
+static int open_cache(void)
+{
+  FILE   *in;
+  char   *line = NULL;
+  size_t  size = 0;
+  size_t  len;
+  int     torn = 0;
+  int     c;
+  void   *tmp;
+
+  in = fopen(cache_file, "rb");
+  if (in != NULL) {
+    for (;;) {
+      len = 0;
+      while ((c = getc(in)) != EOF && c != '\n') {
+        if (len + 1 >= size) {
+          tmp = pool_resize(line, size, size * 2 + 256);
+          if (tmp == NULL) {
+            fprintf(stderr, "open_cache: can't allocate memory; errno=%d\n", errno);
+            fclose(in);
+            pool_free(line, size);
+            return -1;
+          }
+          line = (char *)tmp;
+          size = size * 2 + 256;
+        }
+        line[len++] = (char)c;
+      }
+      /* a line without its newline was still being written */
+      if (c == EOF) {
+        torn = len > 0;
+        break;
+      }
+      line[len] = '\0';
+      if (len > 98)
+        cache_parse(line);
+    }
+    fclose(in);
+    pool_free(line, size);
+  }
+
+  cache.out = open(cache_file, O_WRONLY | O_APPEND | O_CREAT | O_BINARY, 0600);
+  if (cache.out < 0) {
+    fprintf(stderr, "Unable to open cache %s for writing; errno=%d\n", cache_file, errno);
+    return -1;
+  }
+  /* end a line cut short, so that it doesn't take the next one with it */
+  if (torn && write(cache.out, "\n", 1) != 1) {
+    fprintf(stderr, "Unable to write to cache %s; errno=%d\n", cache_file, errno);
+    return -1;
+  }
+  printf("%lu files in cache %s\n", (unsigned long)cache.count, cache_file);
+  return 0;
+}
+
+static int cache_line_add(const char *str)
+{
+  size_t  len = strlen(str);
+  void   *tmp;
+
+  if (cache.line_used + len + 1 > cache.line_size) {
+    tmp = pool_resize(cache.line, cache.line_size, (cache.line_size + len + 1) * 2);
+    if (tmp == NULL)
+      return -1;
+    cache.line      = (char *)tmp;
+    cache.line_size = (cache.line_size + len + 1) * 2;
+  }
+  memcpy(cache.line + cache.line_used, str, len + 1);
+  cache.line_used += len;
+  return 0;
+}
+
+/* print_result() notes each hit of a file being cached. */
+static void cache_note_hit(const char *cardname, const char *pan, long offset, int track)
+{
+  char  hit[CARDTYPELEN + 64];
+
+  if (cache.line_hits++ >= CACHE_MAX_HITS)
+    return;
+  snprintf(hit, sizeof hit, " %ld,%s,%s,%d", offset, cardname, pan, track);
+  if (cache_line_add(hit) < 0)
+    cache.line_hits = CACHE_MAX_HITS + 1;
+}
+
+/* Hash the size of a file and 64KB from its start, middle and end. */
+static int cache_sample_hash(int fd, long size, unsigned char sample[16])
+{
+  struct sha256  ctx;
+  unsigned char  digest[32];
+  unsigned char  sizebuf[8];
+  long           at[3];
+  int            cnt;
+  int            i;
+
+  at[0] = 0;
+  at[1] = size > 3 * CACHE_SAMPLE ? size / 2 - CACHE_SAMPLE / 2 : -1;
+  at[2] = size > CACHE_SAMPLE ? size - CACHE_SAMPLE : -1;
+  sha256_init(&ctx);
+  for (i=0; i<8; i++)
+    sizebuf[i] = (unsigned char)((unsigned long long)size >> (8 * i));
+  sha256_update(&ctx, sizebuf, 8);
+  for (i=0; i<3; i++) {
+    if (at[i] < 0)
+      continue;
+    if (lseek(fd, at[i], SEEK_SET) < 0)
+      return -1;
+    cnt = read(fd, io_buf, CACHE_SAMPLE);
+    if (cnt < 0)
+      return -1;
+    bucket_take(&byte_bucket, cnt);
+    sha256_update(&ctx, io_buf, cnt);
+  }
+  sha256_final(&ctx, digest);
+  memcpy(sample, digest, 16);
+  return 0;
+}
+
+static int cache_full_hash(int fd, unsigned char sha[32])
+{
+  struct sha256  ctx;
+  int            cnt;
+
+  if (lseek(fd, 0, SEEK_SET) < 0)
+    return -1;
+  sha256_init(&ctx);
+  while ((cnt = read(fd, io_buf, IOBUFSIZE)) != 0) {
+    if (cnt < 0 && errno == EINTR)
+      continue;
+    if (cnt < 0 || stop_scan)
+      return -1;
+    bucket_take(&byte_bucket, cnt);
+    sha256_update(&ctx, io_buf, cnt);
+  }
+  sha256_final(&ctx, sha);
+  return 0;
+}
+
+/* Put out the hits recorded for a file as if it had just been scanned. */
+static void cache_replay(const struct cache_entry *entry)
+{
+  const char  *p = cache.pool + entry->hits;
+  char         type[CARDTYPELEN];
+  char         pan[CARDSIZE + 1];
+  long         offset;
+  int          track;
+  int          used;
+  int          len;
+  int          name;
+  int          i;
+
+  cache_replaying = 1;
+  while (sscanf(p, " %ld,%63[A-Z_],%17[0-9],%d%n", &offset, type, pan, &track, &used) == 4) {
+    p  += used;
+    len = strlen(pan);
+    if (len >= CARDSIZE)
+      continue;
+    for (name=0; card_names[name] != NULL && strcmp(card_names[name], type) != 0; name++)
+      ;
+    if (card_names[name] == NULL)
+      continue;
+    for (i=0; i<len; i++)
+      cardbuf[i] = pan[i] - '0';
+    cache_replay_track = track;
+    print_result(card_names[name], len, offset);
+  }
+  cache_replaying = 0;
+}
+
+/*
+ * Before a file is scanned: if the cache has its content, put out the
+ * hits from there and return 1. Otherwise get ready to note what the
+ * scan finds.
+ */
+static int cache_check(int fd, long size)
+{
+  long entry;
+  int  mode = cache_mode();
+
+  cache.hashing   = 0;
+  cache.sha_known = 0;
+  if (cache_sample_hash(fd, size, cache.sample) < 0)
+    return 0;
+  entry = cache_find(cache.sample, size, mode, NULL);
+  if (entry >= 0 && !cache_trust_sample) {
+    if (cache_full_hash(fd, cache.sha) < 0)
+      return 0;
+    cache.sha_known = 1;
+    entry = cache_find(cache.sample, size, mode, cache.sha);
+  }
+  if (entry >= 0) {
+    cache_replay(&cache.entries[entry]);
+    cache_skipped++;
+    return 1;
+  }
+
+  /* hash as it is scanned, unless that has just been done */
+  if (!cache.sha_known) {
+    sha256_init(&cache.ctx);
+    cache.hashing = 1;
+  }
+  cache.line_used = 0;
+  cache.line_hits = 0;
+  cache_line_add("");
+  cache_recording = 1;
+  return 0;
+}
+
+/* After a file has been scanned, whole, add what was found to the cache. */
+static void cache_store(long size)
+{
+  char  head[160];
+  char  sha[65];
+  char  sample[33];
+  char *rec;
+  size_t len;
+  int   mode = cache_mode();
+
+  cache_recording = 0;
+  if (cache.hashing) {
+    cache.hashing = 0;
+    if (cache.ctx.total != (unsigned long long)size)
+      return;
+    sha256_final(&cache.ctx, cache.sha);
+    cache.sha_known = 1;
+  }
+  if (!cache.sha_known || cache.line_hits > CACHE_MAX_HITS)
+    return;
+
+  cache_hex(sha, cache.sha, 32);
+  cache_hex(sample, cache.sample, 16);
+  snprintf(head, sizeof head, "%s %s %ld %d %ld", sha, sample, size, mode, cache.line_hits);
+  if (cache_add(cache.sha, cache.sample, size, mode, cache.line) < 0) {
+    if (!cache.full++)
+      fprintf(stderr, "cache_store: Out of memory budget, not caching more files\n");
+    return;
+  }
+  /* the whole line in one write, so that runs sharing the file don't mix */
+  len = strlen(head) + cache.line_used + 2;
+  rec = (char *)pool_resize(NULL, 0, len);
+  if (rec == NULL)
+    return;
+  snprintf(rec, len, "%s%s\n", head, cache.line);
+  if (write(cache.out, rec, len - 1) != (ssize_t)(len - 1))
+    fprintf(stderr, "cache_store: Unable to write to %s; errno=%d\n", cache_file, errno);
+  pool_free(rec, len);
+}
+
+/* Start the checks afresh, at byte offset start of the data to come. */
+static void scan_reset(long start)
+{
+  scan_offset  = start + 1;
+  scan_counter = 0;
+  ignore_count = 0;
+  initialize_buffer();
+  twin.len  = 0;
+  twin.base = start;
+  twin.done = start;
+}
+
+/*
+ * Scan bytes [lo, hi) of an open file, or all of it when hi is -1. A
+ * range starts a little early and runs a little late so that a number
+ * straddling either edge is still seen whole; print_result() drops the
+ * hits that begin outside it. size is the file size if known, or -1;
+ * a short read that reaches it is taken as the end, which saves small
+ * files the read that would only return 0. Returns 1 if the file should
+ * be given up on (-l limit, -a, triage hit), SCAN_DEADLINE if the
+ * deadline passed with data still unread, -1 on a read error.
+ */
+#define SCAN_DEADLINE 2
+
+static int scan_fd(int fd, int *direct, long lo, long hi, long size)
+{
+  int   late           = 0;
+  int   cnt            = 0;
+  int   want           = 0;
+  int   skip           = 0;
+  int   pos            = 0;
+  int   len            = 0;
+  int   limit_exceeded = 0;
+  long  range_start    = 0;
+  long  range_left     = -1;
+  long  read_offset    = 0;
+  double started       = 0;
+
+  scan_range_lo = lo;
+  scan_range_hi = hi;
+  if (hi >= 0) {
+    range_start = lo > RANGE_OVERLAP ? lo - RANGE_OVERLAP : 0;
+    range_left  = hi + RANGE_OVERLAP - range_start;
+  }
+  scan_reset(range_start);
+
+  /* direct reads have to start on an aligned offset */
+  read_offset = *direct ? range_start - range_start % IOALIGN : range_start;
+  skip        = range_start - read_offset;
+  if (lseek(fd, read_offset, SEEK_SET) < 0) {
+    fprintf(stderr, "ccsrch: Unable to seek to %ld in %s; errno=%d\n", read_offset, currfilename, errno);
+    return -1;
+  }
+
+  while (limit_exceeded == 0 && !stop_scan && range_left != 0) {
+    late = check_deadline();
+    want = IOBUFSIZE;
+    if (!*direct && range_left > 0 && range_left + skip < want)
+      want = range_left + skip;
+    started = adaptive_latency > 0 ? now_seconds() : 0;
+    cnt = read(fd, io_buf, want);
+    if (cnt < 0 && errno == EINTR)
+      continue;
+#ifdef O_DIRECT
+    if (cnt < 0 && errno == EINVAL && *direct) {
+      fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+      *direct = 0;
+      continue;
+    }
+#endif
+    if (cnt < 0)
+      return -1;
+    if (cnt == 0)
+      break;
+    /* past the deadline, only a read that finds nothing more ends the file whole */
+    if (late) {
+      limit_exceeded = SCAN_DEADLINE;
+      break;
+    }
+    /* the checks peek a few bytes past the end of the data */
+    memset(io_buf + cnt, '\0', IOPAD);
+
+#ifdef POSIX_FADV_DONTNEED
+    if (gentle_io && !*direct)
+      posix_fadvise(fd, read_offset, cnt, POSIX_FADV_DONTNEED);
+#endif
+    read_offset += cnt;
+    if (adaptive_latency > 0)
+      adapt_to_latency(now_seconds() - started);
+    bucket_take(&byte_bucket, cnt);
+    if (cache.hashing)
+      sha256_update(&cache.ctx, io_buf + skip, cnt - skip);
+
+    /* feed the checks in BSIZE pieces, as the old fread loop did */
+    for (pos=skip; pos<cnt && limit_exceeded==0; pos+=len) {
+      len = cnt - pos < BSIZE - 1 || track_mode ? cnt - pos : BSIZE - 1;
+      if (range_left >= 0 && len > range_left)
+        len = range_left;
+      if (len == 0)
+        break;
+      ccsrch_buf = io_buf + pos;
+
+      if (limit_ascii && !is_ascii_buf(ccsrch_buf, len)) {
+        currfile_not_ascii = 1;
+        limit_exceeded = 1;
+        break;
+      }
+      limit_exceeded = track_mode ? track_feed(ccsrch_buf, len) : scan_chunk(len);
+      if (range_left > 0)
+        range_left -= len;
+    }
+    skip = 0;
+    if (cnt < want && size >= 0 && read_offset >= size)
+      break;
+  }
+  if (track_mode && limit_exceeded == 0 && !stop_scan)
+    limit_exceeded = track_feed(NULL, 0);
+  return limit_exceeded;
+}
+
+static int block_offset_cmp(const void *a, const void *b)
+{
+  long x = *(const long *)a;
+  long y = *(const long *)b;
+
+  return x < y ? -1 : x > y;
+}
+
+/*
+ * Triage of a large file: its head, its tail and --sample-blocks blocks
+ * from in between. The blocks are picked by a generator seeded from the
+ * path, so a rerun looks at the same places.
+ */
+static int scan_sampled(int fd, int *direct, long size)
+{
+  long          *offsets;
+  unsigned long long seed = 2166136261UL;
+  const char    *p;
+  int            count = sample_blocks + 2;
+  int            i;
+  int            ret   = 0;
+  long           span  = size - 2 * SAMPLE_BLOCK;
+
+  offsets = (long *)malloc(count * sizeof(long));
+  if (offsets == NULL) {
+    fprintf(stderr, "scan_sampled: can't allocate memory; errno=%d\n", errno);
+    return scan_fd(fd, direct, 0, -1, size);
+  }
+  for (p=currfilename; *p != '\0'; p++)
+    seed = (seed ^ (unsigned char)*p) * 16777619UL;
+
+  offsets[0] = 0;
+  offsets[1] = size - SAMPLE_BLOCK;
+  for (i=2; i<count; i++) {
+    seed       = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+    offsets[i] = SAMPLE_BLOCK + (long)((seed >> 16) % (unsigned long long)span);
+  }
+  qsort(offsets, count, sizeof(long), block_offset_cmp);
+
+  for (i=0; i<count && ret == 0 && !stop_scan; i++)
+    ret = scan_fd(fd, direct, offsets[i], offsets[i] + SAMPLE_BLOCK, size);
+  free(offsets);
+  return ret;
+}
+
+static int ccsrch(const char *filename)
+{
+  int          fd       = -1;
+  int          total    = 0;
+  int          direct   = 0;
+  int          cached   = 0;
+  long         range_lo = scan_range_lo;
+  long         range_hi = scan_range_hi;
+  long         size     = currfile_size;
+
+#ifdef DEBUG
+  printf("Processing file %s\n",filename);
+#endif
+
+  ccsrch_index  = 0;
+  currfile_size = -1;
+  errno         = 0;
+  fd = open_scan_file(filename);
+  if (fd < 0) {
+    if (errno==13) {
+      fprintf(stderr, "ccsrch: Unable to open file %s for reading; Permission Denied\n", filename);
+    } else {
+      fprintf(stderr, "ccsrch: Unable to open file %s for reading; errno=%d\n", filename, errno);
+    }
+    return -1;
+  }
+  currfilename    = filename;
+  currfile_sampled = 0;
+  currfile_not_ascii = 0;
+  file_count++;
+  /* the cache reads samples at any offset, so it goes before O_DIRECT */
+  if (cache_file != NULL && range_hi < 0 && limit_file_results == 0 && !raw_scanning &&
+      size >= 0 && !(triage_mode && size > sample_threshold && size > 4 * SAMPLE_BLOCK))
+    cached = cache_check(fd, size);
+  if (!cached)
+    direct = try_direct_io(fd, size);
+
+#ifdef POSIX_FADV_SEQUENTIAL
+  if (gentle_io)
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+  if (triage_mode && range_hi < 0 && size > sample_threshold && size > 4 * SAMPLE_BLOCK) {
+    currfile_sampled = 1;
+    total = scan_sampled(fd, &direct, size);
+  } else if (cached) {
+    total = 0;
+  } else {
+    total = scan_fd(fd, &direct, range_lo, range_hi, size);
+    /* only a scan that ran to the end (not cut short by triage, -a or the deadline) is kept */
+    if (cache_recording) {
+      if (total != 0 || stop_scan)
+        cache_recording = cache.hashing = 0;
+      else
+        cache_store(size);
+    }
+  }
+  scan_range_lo = range_lo;
+  scan_range_hi = range_hi;
+
+  close(fd);
+
+  if (total == SCAN_DEADLINE)
+    return SCAN_DEADLINE;
+  return total < 0 ? -1 : 0;
+}
+
+/*
+ * One read buffer for every file, aligned for O_DIRECT, with a little
+ * zeroed slack either side for the checks that peek past the data.
+ */
+static int alloc_io_buf(void)
+{
+  char *base;
+
+  base = (char *)pool_buffer(IOBUFSIZE + IOALIGN + 2 * IOPAD);
+  /* and --track-only's window, so that both are had before starting */
+  if (base != NULL && track_mode)
+    twin.buf = (char *)pool_buffer(IOBUFSIZE + TRACK_BEFORE + TRACK_AFTER + IOPAD);
+  if (base == NULL || (track_mode && twin.buf == NULL)) {
+    if (pool.limit != 0)
+      fprintf(stderr, "alloc_io_buf: --max-memory is too small for the read buffers\n");
+    else
+      fprintf(stderr, "alloc_io_buf: can't allocate memory; errno=%d\n", errno);
+    return -1;
+  }
+  io_buf = (char *)(((uintptr_t)base + IOPAD + IOALIGN - 1) & ~(uintptr_t)(IOALIGN - 1));
+  return 0;
+}
+
+static void note_file_stat(const struct stat *fileattr)
+{
+  currfile_atime=fileattr->st_atime;
+  currfile_mtime=fileattr->st_mtime;
+  currfile_ctime=fileattr->st_ctime;
+  currfile_size=fileattr->st_size;
+}
+
+static int get_file_stat(const char *inputfile, struct stat *fileattr)
+{
+  int   err     = 0;
+
+  err = stat(inputfile, fileattr);
+#ifdef AT_FDCWD
+  if (err != 0 && errno == ENAMETOOLONG)
+    err = stat_long(inputfile, fileattr);
+#endif
+  if (err != 0) {
+    if (errno == ENOENT) {
+      fprintf(stderr, "get_file_stat: File %s not found, can't get stat info\n", inputfile);
+    } else {
+      fprintf(stderr, "get_file_stat: Cannot stat file %s; errno=%d\n", inputfile, errno);
+    }
+    return -1;
+  }
+  note_file_stat(fileattr);
+  return 0;
+}
+
+static const char *get_filename_ext(const char *filename)
+{
+  const char *slash = strrchr(filename, '/');
+  const char *dot   = strrchr(slash != NULL ? slash : filename, '.');
+  if(!dot || dot == slash)
+    return "";
+  return dot;
+}
+
+/*
+ * Returns 1 if the extension of name is in the -n list. The list is
+ * already lower case; the extension is lowered as it is compared, so
+ * nothing is copied.
+ */
+static int is_allowed_file_type(const char *name)
+{
+  const char *ext   = NULL;
+  const char *entry = NULL;
+  size_t      len   = 0;
+  size_t      i     = 0;
+
+  if (exclude_extensions == NULL)
+    return 0;
+
+  ext = get_filename_ext(name);
+  if (ext[0] == '\0')
+    return 0;
+  len = strlen(ext);
+  for (entry=exclude_extensions; *entry != '\0'; entry+=i) {
+    for (i=0; i<len && entry[i] == tolower((unsigned char)ext[i]); i++)
+      ;
+    if (i == len && (entry[i] == ',' || entry[i] == '\0'))
+      return 1;
+    /* on to the next entry */
+    for (; entry[i] != ',' && entry[i] != '\0'; i++)
+      ;
+    if (entry[i] == ',')
+      i++;
+  }
+  return 0;
+}
+
+/*
+ * Compare two paths in the order a sorted walk visits them. Paths are
+ * compared component by component, so "a/x" comes before "a-b" even
+ * though '-' sorts before '/'.
+ */
+static int walk_order_cmp(const char *a, const char *b)
+{
+  for (; *a != '\0' && *a == *b; a++, b++)
+    ;
+  if (*a == *b)
+    return 0;
+  if (*a == '\0' || *a == '/')
+    return -1;
+  if (*b == '\0' || *b == '/')
+    return 1;
+  return (unsigned char)*a - (unsigned char)*b;
+}
+
+static void set_done_cursor(const char *path)
+{
+  size_t  len = strlen(path) + 1;
+  char   *tmp;
+
+  if (len > done.cursor_size) {
+    tmp = (char *)realloc(done.cursor, len);
+    if (tmp == NULL) {
+      fprintf(stderr, "set_done_cursor: can't allocate memory; errno=%d\n", errno);
+      return;
+    }
+    done.cursor      = tmp;
+    done.cursor_size = len;
+  }
+  memcpy(done.cursor, path, len);
+}
+
+static void take_snapshot(long input)
+{
+  done.input  = input;
+  done.files  = file_count;
+  done.hits   = total_count;
+  done.tracks = trackdatacount;
+  if (logfilefd != NULL)
+    done.log_offset = ftell(logfilefd);
+}
+
+static int write_checkpoint(void)
+{
+  char   *tmpname    = NULL;
+  FILE   *out        = NULL;
+  size_t  len        = strlen(checkpoint_file) + 5;
+  size_t  cursor_len = done.cursor != NULL ? strlen(done.cursor) : 0;
+  int     err        = 0;
+
+  tmpname = (char *)malloc(len);
+  if (tmpname == NULL) {
+    fprintf(stderr, "write_checkpoint: can't allocate memory; errno=%d\n", errno);
+    return -1;
+  }
+  snprintf(tmpname, len, "%s.tmp", checkpoint_file);
+
+  /* the log has to be on disk before a checkpoint that vouches for it */
+  if (logfilefd != NULL) {
+    fflush(logfilefd);
+    fsync(fileno(logfilefd));
+  }
+
+  out = fopen(tmpname, "wb");
+  if (out == NULL) {
+    fprintf(stderr, "Unable to write checkpoint %s; errno=%d\n", tmpname, errno);
+    free(tmpname);
+    return -1;
+  }
+  fprintf(out, "ccsrch-checkpoint 1\ninput %ld\nfiles %ld\nhits %ld\ntracks %d\n"
+          "elapsed %ld\nlogoffset %ld\ncursor %lu\n",
+          done.input, done.files, done.hits, done.tracks,
+          (long)(time(NULL) - init_time), done.log_offset, (unsigned long)cursor_len);
+  fwrite(done.cursor, 1, cursor_len, out);
+  fputc('\n', out);
+  if (fflush(out) != 0 || fsync(fileno(out)) != 0 || ferror(out))
+    err = errno;
+  fclose(out);
+
+  if (err == 0) {
+#ifdef _WIN32
+    remove(checkpoint_file);
+#endif
+    if (rename(tmpname, checkpoint_file) != 0)
+      err = errno;
+  }
+  if (err != 0) {
+    fprintf(stderr, "Unable to write checkpoint %s; errno=%d\n", checkpoint_file, err);
+    remove(tmpname);
+  }
+  free(tmpname);
+  last_checkpoint = time(NULL);
+  return err == 0 ? 0 : -1;
+}
+
+static void maybe_checkpoint(void)
+{
+  if (checkpoint_file != NULL && time(NULL) - last_checkpoint >= checkpoint_interval)
+    write_checkpoint();
+}
+
+static void file_done(const char *filename)
+{
+  if (checkpoint_file == NULL)
+    return;
+  /* a file the deadline cut short never gets here */
+  if (batch.flushing)
+    return;
+  /*
+   * A file given as an input (-F, a plan, a file argument) finishes that
+   * input, so a resume must not scan it again and log its hits twice.
+   */
+  if (input_is_file) {
+    set_done_cursor("");
+    take_snapshot(input_index + 1);
+  } else {
+    set_done_cursor(filename);
+    take_snapshot(input_index);
+  }
+  maybe_checkpoint();
+}
+
+/* Called once a top-level path (argument or stdin line) is finished. */
+static void input_done(void)
+{
+  input_index++;
+  free(resume_cursor);
+  resume_cursor = NULL;
+  /* files still waiting in a batch, or skipped at the deadline, are not done */
+  if (checkpoint_file == NULL || batch.count > 0 || deadline_passed)
+    return;
+  set_done_cursor("");
+  take_snapshot(input_index);
+  maybe_checkpoint();
+}
+
+static int read_checkpoint(void)
+{
+  FILE          *in         = NULL;
+  int            version    = 0;
+  long           elapsed    = 0;
+  unsigned long  cursor_len = 0;
+
+  in = fopen(checkpoint_file, "rb");
+  if (in == NULL) {
+    if (errno == ENOENT) {
+      printf("No checkpoint at %s, starting a new scan\n", checkpoint_file);
+      return 0;
+    }
+    fprintf(stderr, "Unable to open checkpoint %s for reading; errno=%d\n", checkpoint_file, errno);
+    return -1;
+  }
+
+  if (fscanf(in, "ccsrch-checkpoint %d input %ld files %ld hits %ld tracks %d "
+             "elapsed %ld logoffset %ld cursor %lu",
+             &version, &done.input, &done.files, &done.hits, &done.tracks,
+             &elapsed, &done.log_offset, &cursor_len) != 8 ||
+      version != 1 || fgetc(in) != '\n') {
+    fprintf(stderr, "Checkpoint %s is damaged or from another version\n", checkpoint_file);
+    fclose(in);
+    return -1;
+  }
+
+  if (cursor_len > 0) {
+    resume_cursor = (char *)malloc(cursor_len + 1);
+    if (resume_cursor == NULL || fread(resume_cursor, 1, cursor_len, in) != cursor_len) {
+      fprintf(stderr, "Checkpoint %s is damaged\n", checkpoint_file);
+      fclose(in);
+      return -1;
+    }
+    resume_cursor[cursor_len] = '\0';
+    set_done_cursor(resume_cursor);
+  }
+  fclose(in);
+
+  resume_input   = done.input;
+  input_index    = 0;
+  file_count     = done.files;
+  total_count    = done.hits;
+  trackdatacount = done.tracks;
+  init_time     -= elapsed;
+
+  /* drop whatever the interrupted run logged after its last checkpoint */
+  if (logfilefd != NULL) {
+    fflush(logfilefd);
+    fseek(logfilefd, 0, SEEK_END);
+    if (ftell(logfilefd) < done.log_offset) {
+      fprintf(stderr, "Log file %s is shorter than the checkpoint expects; not truncating it\n", logfilename);
+      done.log_offset = ftell(logfilefd);
+    } else if (ftruncate(fileno(logfilefd), done.log_offset) != 0) {
+      fprintf(stderr, "Unable to truncate log file %s; errno=%d\n", logfilename, errno);
+      return -1;
+    }
+    fseek(logfilefd, 0, SEEK_END);
+  }
+
+  printf("Resuming from checkpoint %s (%ld files, %ld matches so far)\n",
+         checkpoint_file, file_count, total_count);
+  return 0;
+}
+
+/*
+ * On --resume, skip what the checkpointed run already finished: every
+ * file up to and including the cursor, and every directory whose whole
+ * subtree sorts before it. The cursor is dropped once the walk passes it.
+ */
+static int resume_skip(const char *path, int is_dir)
+{
+  if (resume_cursor == NULL)
+    return 0;
+  if (is_dir && strncmp(path, resume_cursor, strlen(path)) == 0)
+    return 0;
+  if (walk_order_cmp(path, resume_cursor) <= 0)
+    return 1;
+  free(resume_cursor);
+  resume_cursor = NULL;
+  return 0;
+}
+
+/* Shell-style match of '*' and '?'; '*' also matches '/'. */
+static int glob_match(const char *pattern, const char *str)
+{
+  const char *star  = NULL;
+  const char *retry = NULL;
+
+  while (*str != '\0') {
+    if (*pattern == '*') {
+      star  = ++pattern;
+      retry = str;
+    } else if (*pattern == '?' || *pattern == *str) {
+      pattern++;
+      str++;
+    } else if (star != NULL) {
+      pattern = star;
+      str     = ++retry;
+    } else {
+      return 0;
+    }
+  }
+  while (*pattern == '*')
+    pattern++;
+  return *pattern == '\0';
+}
+
+/* Is the extension of filename (case ignored) in a comma separated list? */
+static int ext_in_list(const char *filename, const char *list)
+{
+  const char *slash = strrchr(filename, '/');
+  const char *ext   = strrchr(slash != NULL ? slash : filename, '.');
+  size_t      len;
+  size_t      i;
+
+  if (ext == NULL)
+    return 0;
+  len = strlen(ext);
+  while (*list != '\0') {
+    for (i=0; i<len && tolower((unsigned char)list[i]) == tolower((unsigned char)ext[i]); i++)
+      ;
+    if (i == len && (list[i] == ',' || list[i] == '\0'))
+      return 1;
+    list = strchr(list, ',');
+    if (list == NULL)
+      break;
+    list++;
+  }
+  return 0;
+}
+
+static int priority_score(const char *filename, const struct stat *fileattr)
+{
+  struct priority_rule *rule;
+  double                age   = difftime(init_time, fileattr->st_mtime);
+  int                   score = 0;
+  int                   match = 0;
+  int                   i;
+
+  for (i=0; i<priority_rule_count; i++) {
+    rule = &priority_rules[i];
+    switch (rule->type) {
+      case RULE_EXT:     match = ext_in_list(filename, rule->arg); break;
+      case RULE_PATH:    match = glob_match(rule->arg, filename); break;
+      case RULE_LARGER:  match = fileattr->st_size > rule->value; break;
+      case RULE_SMALLER: match = fileattr->st_size < rule->value; break;
+      case RULE_NEWER:   match = age < rule->value; break;
+      case RULE_OLDER:   match = age > rule->value; break;
+    }
+    if (match)
+      score += rule->weight;
+  }
+  return score;
+}
+
+/*
+ * One rule per line, "<kind> <argument> <weight>":
+ *   ext .csv,.log 40      path *logs* 20
+ *   larger 1024 -30       smaller 64 10     (MB)
+ *   newer 30 20           older 1825 -10    (days since modified)
+ * Blank lines and lines starting with '#' are ignored.
+ */
+static int add_priority_rule(const char *line, int lineno)
+{
+  static const char    *kinds[] = { "ext", "path", "larger", "smaller", "newer", "older" };
+  struct priority_rule *rule;
+  void                 *tmp;
+  char                  kind[16];
+  char                  arg[MAXPATH];
+  int                   weight;
+  int                   i;
+
+  while (isspace((unsigned char)*line))
+    line++;
+  if (*line == '\0' || *line == '#')
+    return 0;
+  if (sscanf(line, "%15s %2047s %d", kind, arg, &weight) != 3) {
+    fprintf(stderr, "Priority policy line %d: expected <kind> <argument> <weight>\n", lineno);
+    return -1;
+  }
+  for (i=0; i<6 && strcmp(kind, kinds[i]) != 0; i++)
+    ;
+  if (i == 6) {
+    fprintf(stderr, "Priority policy line %d: unknown rule %s\n", lineno, kind);
+    return -1;
+  }
+
+  tmp = realloc(priority_rules, (priority_rule_count + 1) * sizeof(struct priority_rule));
+  if (tmp == NULL) {
+    fprintf(stderr, "add_priority_rule: can't allocate memory; errno=%d\n", errno);
+    return -1;
+  }
+  priority_rules = (struct priority_rule *)tmp;
+  rule           = &priority_rules[priority_rule_count++];
+  rule->type     = i;
+  rule->weight   = weight;
+  rule->arg      = NULL;
+  rule->value    = atof(arg);
+  if (i == RULE_EXT || i == RULE_PATH) {
+    rule->arg = strdup(arg);
+    if (rule->arg == NULL)
+      return -1;
+  } else if (i == RULE_LARGER || i == RULE_SMALLER) {
+    rule->value *= 1024 * 1024;
+  } else {
+    rule->value *= 24 * 60 * 60;
+  }
+  return 0;
+}
+
+static int load_priority_policy(const char *filename)
+{
+  FILE       *in;
+  char        line[MAXPATH + 64];
+  const char *p;
+  const char *nl;
+  size_t      len;
+  int         lineno = 0;
+  int         err    = 0;
+
+  if (strcmp(filename, "default") == 0) {
+    for (p=default_priority_policy; *p != '\0' && err == 0; p=nl+1) {
+      nl  = strchr(p, '\n');
+      len = nl - p;
+      memcpy(line, p, len);
+      line[len] = '\0';
+      err = add_priority_rule(line, ++lineno);
+    }
+    return err;
+  }
+
+  in = fopen(filename, "r");
+  if (in == NULL) {
+    fprintf(stderr, "Unable to open priority policy %s; errno=%d\n", filename, errno);
+    return -1;
+  }
+  while (err == 0 && fgets(line, sizeof line, in) != NULL)
+    err = add_priority_rule(line, ++lineno);
+  fclose(in);
+  return err;
+}
+
+/*
+ * --deadline takes seconds from now (with an optional m or h suffix) or
+ * a wall clock time, HH:MM, today or else tomorrow.
+ */
+static time_t parse_deadline(const char *arg)
+{
+  struct tm  *tm;
+  time_t      now = time(NULL);
+  time_t      when;
+  char       *end;
+  int         hour;
+  int         min;
+  double      secs;
+
+  if (strchr(arg, ':') != NULL) {
+    if (sscanf(arg, "%d:%d", &hour, &min) != 2 || hour < 0 || hour > 23 || min < 0 || min > 59)
+      return 0;
+    tm          = localtime(&now);
+    tm->tm_hour = hour;
+    tm->tm_min  = min;
+    tm->tm_sec  = 0;
+    when        = mktime(tm);
+    if (when <= now)
+      when += 24 * 60 * 60;
+    return when;
+  }
+
+  secs = strtod(arg, &end);
+  if (*end == 'm')
+    secs *= 60;
+  else if (*end == 'h')
+    secs *= 60 * 60;
+  else if (*end != '\0')
+    return 0;
+  return secs > 0 ? now + (time_t)secs : 0;
+}
+
+static void note_unreached(const char *filename)
+{
+  unreached_count++;
+  if (unreached_out != NULL)
+    fprintf(unreached_out, "%s\n", filename);
+  else
+    print_status(filename, "NOT_REACHED");
+}
+
+/*
+ * The file being scanned when the deadline passed. Its hits so far are
+ * already out; it still goes on the --unreached list to be scanned again.
+ */
+static void note_partial(const char *filename)
+{
+  partial_count++;
+  if (unreached_out != NULL)
+    fprintf(unreached_out, "%s\n", filename);
+  print_status(filename, "PARTIAL");
+}
+
+/*
+ * Triage prints one line per file instead of one per hit: CONFIRMED if a
+ * number was found, SAMPLED_CLEAN if only samples of it were read and
+ * came up empty, CLEAN if all of it was, UNREADABLE if it couldn't be.
+ * A file -a gave up on as binary before any hit is left out, as it
+ * would be without triage.
+ */
+static void print_triage(const char *filename, int err)
+{
+  const char *status;
+
+  if (err < 0) {
+    status = "UNREADABLE";
+    triage_unreadable++;
+  } else if (file_hit_count > 0) {
+    status = "CONFIRMED";
+    triage_confirmed++;
+  } else if (currfile_not_ascii) {
+    return;
+  } else if (currfile_sampled) {
+    status = "SAMPLED_CLEAN";
+    triage_sampled++;
+  } else {
+    status = "CLEAN";
+    triage_clean++;
+  }
+
+  print_status(filename, status);
+}
+
+/*
+ * Scan one regular file and account for it. Every walk mode hands its
+ * files to ccsrch() through here.
+ */
+static void scan_file(const char *filename)
+{
+  int err = 0;
+
+  if (check_deadline()) {
+    note_unreached(filename);
+    return;
+  }
+
+  /* reset file_hit_count so we can keep track of many hits each file has */
+  file_hit_count = 0;
+  bucket_take(&file_bucket, 1);
+
+  /*
+   * kludge, need to clean this up
+   * later else any string matching in the path returns non NULL
+   */
+  if (logfilename != NULL && strstr(filename, logfilename) != NULL) {
+    fprintf(stderr, "We seem to be hitting our log file, so we'll leave this out of the search -> %s\n", filename);
+    return;
+  }
+
+  err = ccsrch(filename);
+  if (file_hit_count > 0 && print_file_hit_count == 1)
+    printf("%s: %d hits\n", filename, file_hit_count);
+  if (err == SCAN_DEADLINE) {
+    note_partial(filename);
+    return;
+  }
+  if (triage_mode && !stop_scan)
+    print_triage(filename, err);
+
+  if (!stop_scan)
+    file_done(filename);
+}
+
+/*
+ * Physical offset of a file's first extent, from FIEMAP. Returns -1
+ * where that isn't available (other systems, tmpfs, empty files).
+ */
+static int first_extent(const char *filename, unsigned long long *physical)
+{
+#ifdef FS_IOC_FIEMAP
+  static struct fiemap *fm = NULL;
+  int                   fd;
+  int                   ret = -1;
+
+  if (fm == NULL) {
+    fm = (struct fiemap *)calloc(1, sizeof(struct fiemap) + sizeof(struct fiemap_extent));
+    if (fm == NULL)
+      return -1;
+  }
+  fd = open_path(filename, O_RDONLY | O_BINARY);
+  if (fd < 0)
+    return -1;
+  memset(fm, 0, sizeof(struct fiemap) + sizeof(struct fiemap_extent));
+  fm->fm_length       = ~0ULL;
+  fm->fm_extent_count = 1;
+  if (ioctl(fd, FS_IOC_FIEMAP, fm) == 0 && fm->fm_mapped_extents > 0) {
+    *physical = fm->fm_extents[0].fe_physical;
+    ret = 0;
+  }
+  close(fd);
+  return ret;
+#else
+  (void)filename;
+  (void)physical;
+  return -1;
+#endif
+}
+
+static int batch_item_cmp(const void *a, const void *b)
+{
+  const struct batch_item *x = (const struct batch_item *)a;
+  const struct batch_item *y = (const struct batch_item *)b;
+
+  /* equal scores keep walk order, i.e. the order they were queued in */
+  if (scan_order == ORDER_PRIORITY) {
+    if (x->key != y->key)
+      return x->key < y->key ? -1 : 1;
+    return x->path < y->path ? -1 : x->path > y->path;
+  }
+
+  if (x->dev != y->dev)
+    return x->dev < y->dev ? -1 : 1;
+  if (x->key != y->key)
+    return x->key < y->key ? -1 : 1;
+  return 0;
+}
+
+/*
+ * Scan the batch in disk order. For checkpoints the batch only counts as
+ * done once all of it is, and then up to its last file in walk order.
+ */
+static void flush_batch(void)
+{
+  struct batch_item *item;
+  size_t             i;
+
+  if (batch.count == 0)
+    return;
+  qsort(batch.items, batch.count, sizeof(struct batch_item), batch_item_cmp);
+
+  batch.flushing = 1;
+  for (i=0; i<batch.count && (int)i < prefetch_window; i++)
+    prefetch_file(batch.paths + batch.items[i].path);
+  for (i=0; i<batch.count && !stop_scan; i++) {
+    item = &batch.items[i];
+    if (i + prefetch_window < batch.count)
+      prefetch_file(batch.paths + batch.items[i + prefetch_window].path);
+    if (deadline_passed) {
+      note_unreached(batch.paths + item->path);
+      continue;
+    }
+    currfile_atime = item->atime;
+    currfile_mtime = item->mtime;
+    currfile_ctime = item->ctime;
+    currfile_size  = item->size;
+    scan_file(batch.paths + item->path);
+  }
+  batch.flushing = 0;
+
+  if (!stop_scan && !deadline_passed && checkpoint_file != NULL) {
+    set_done_cursor(batch.paths + batch.last);
+    take_snapshot(batch.input);
+    maybe_checkpoint();
+  }
+  batch.count      = 0;
+  batch.paths_used = 0;
+}
+
+/* Make room for one more item with a name of len bytes. */
+static int batch_grow(size_t len)
+{
+  void *tmp;
+
+  if (batch.count == batch.items_size) {
+    tmp = pool_resize(batch.items, batch.items_size * sizeof(struct batch_item),
+                      (batch.items_size * 2 + 64) * sizeof(struct batch_item));
+    if (tmp == NULL)
+      return -1;
+    batch.items      = (struct batch_item *)tmp;
+    batch.items_size = batch.items_size * 2 + 64;
+  }
+  if (batch.paths_used + len > batch.paths_size) {
+    tmp = pool_resize(batch.paths, batch.paths_size, (batch.paths_size + len) * 2);
+    if (tmp == NULL)
+      return -1;
+    batch.paths      = (char *)tmp;
+    batch.paths_size = (batch.paths_size + len) * 2;
+  }
+  return 0;
+}
+
+static void batch_file(const char *filename, const struct stat *fileattr)
+{
+  struct batch_item  *item;
+  size_t              len = strlen(filename) + 1;
+  int                 full;
+
+  /*
+   * Near the memory budget, scan what is queued before taking more, so
+   * that the walk waits instead of memory growing.
+   */
+  full = batch.count == batch.items_size || batch.paths_used + len > batch.paths_size;
+  if (full && batch.count > 0 && (pool_tight() || batch_grow(len) < 0))
+    flush_batch();
+  if (batch_grow(len) < 0) {
+    if (pool.limit == 0)
+      fprintf(stderr, "batch_file: can't allocate memory; errno=%d\n", errno);
+    scan_file(filename);
+    return;
+  }
+
+  item        = &batch.items[batch.count++];
+  item->path  = batch.paths_used;
+  item->dev   = fileattr->st_dev;
+  item->key   = fileattr->st_ino;
+  item->atime = fileattr->st_atime;
+  item->mtime = fileattr->st_mtime;
+  item->ctime = fileattr->st_ctime;
+  item->size  = fileattr->st_size;
+  /* files FIEMAP can't place go after the rest, in inode order */
+  if (scan_order == ORDER_EXTENT && first_extent(filename, &item->key) < 0)
+    item->key = 1ULL << 63 | fileattr->st_ino;
+  else if (scan_order == ORDER_PRIORITY)
+    item->key = (1ULL << 40) - priority_score(filename, fileattr);
+  memcpy(batch.paths + batch.paths_used, filename, len);
+  batch.last        = batch.paths_used;
+  batch.input       = input_index;
+  batch.paths_used += len;
+
+  if (batch.count >= batch.limit)
+    flush_batch();
+}
+
+static int open_plan_out(void)
+{
+  plan_out = fopen(plan_out_file, "wb");
+  if (plan_out == NULL) {
+    fprintf(stderr, "Unable to open plan %s for writing; errno=%d\n", plan_out_file, errno);
+    return -1;
+  }
+  fprintf(plan_out, "ccsrch-plan 1\n");
+  return 0;
+}
+
+/*
+ * Every regular file the walk turns up comes through here, to be scanned
+ * now or, with --make-plan, written to the plan for a later sharded run.
+ * Plan records are "<size> <path>" terminated by a NUL, so that any name
+ * survives the trip.
+ */
+static void dispatch_file(const char *filename, const struct stat *fileattr)
+{
+  if (plan_out != NULL) {
+    fprintf(plan_out, "%ld %s", (long)fileattr->st_size, filename);
+    fputc('\0', plan_out);
+    plan_files++;
+    plan_bytes += fileattr->st_size;
+    return;
+  }
+  if (scan_order != ORDER_WALK) {
+    batch_file(filename, fileattr);
+    return;
+  }
+  scan_file(filename);
+}
+
+static int dir_entry_cmp(const void *a, const void *b)
+{
+  return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/*
+ * Read a whole directory and sort it by name, so that the walk order is
+ * the same from one run to the next. Returns a NULL terminated list
+ * allocated as a single block.
+ */
+static char **read_sorted_dir(DIR *dirptr)
+{
+  struct dirent  *direntptr;
+  char           *names = NULL;
+  char           *tmp   = NULL;
+  char          **list  = NULL;
+  size_t          used  = 0;
+  size_t          size  = 0;
+  size_t          count = 0;
+  size_t          len   = 0;
+  size_t          i     = 0;
+
+  while ((direntptr = readdir(dirptr)) != NULL) {
+    if ((strcmp(direntptr->d_name, ".") == 0) ||
+        (strcmp(direntptr->d_name, "..") == 0))
+      continue;
+    len = strlen(direntptr->d_name) + 1;
+    if (used + len > size) {
+      size = (size + len) * 2;
+      tmp  = (char *)realloc(names, size);
+      if (tmp == NULL) {
+        free(names);
+        return NULL;
+      }
+      names = tmp;
+    }
+    memcpy(names + used, direntptr->d_name, len);
+    used += len;
+    count++;
+  }
+
+  list = (char **)malloc((count + 1) * sizeof(char *) + used);
+  if (list == NULL) {
+    free(names);
+    return NULL;
+  }
+  tmp = (char *)(list + count + 1);
+  if (used > 0)
+    memcpy(tmp, names, used);
+  free(names);
+  for (i=0; i<count; i++) {
+    list[i] = tmp;
+    tmp += strlen(tmp) + 1;
+  }
+  list[count] = NULL;
+  qsort(list, count, sizeof(char *), dir_entry_cmp);
+  return list;
+}
+
+static const char *next_dir_entry(DIR *dirptr, char **sorted, size_t *pos)
+{
+  struct dirent *direntptr;
+
+  if (sorted != NULL)
+    return sorted[*pos] != NULL ? sorted[(*pos)++] : NULL;
+  direntptr = readdir(dirptr);
+  return direntptr != NULL ? direntptr->d_name : NULL;
+}
+
+static int walk_path_add(const char *name)
+{
+  size_t  len = strlen(name);
+  void   *tmp;
+
+  if (walk_path.len + len + 2 > walk_path.size) {
+    tmp = realloc(walk_path.buf, (walk_path.len + len + 2) * 2);
+    if (tmp == NULL) {
+      fprintf(stderr, "walk_path_add: can't allocate memory; errno=%d\n", errno);
+      return -1;
+    }
+    walk_path.buf  = (char *)tmp;
+    walk_path.size = (walk_path.len + len + 2) * 2;
+  }
+  memcpy(walk_path.buf + walk_path.len, name, len + 1);
+  walk_path.len += len;
+  return 0;
+}
+
+/*
+ * Directories and files are opened and stat'ed relative to the directory
+ * they are in, so the kernel never has to resolve a long path; the full
+ * path is only for output. Systems without openat() use the full path.
+ */
+static DIR *walk_opendir(DIR *parent, const char *name)
+{
+#ifdef AT_FDCWD
+  int  fd;
+  DIR *dirptr;
+
+  if (parent != NULL) {
+    fd = openat(dirfd(parent), name, O_RDONLY | O_DIRECTORY);
+    if (fd < 0)
+      return NULL;
+    dirptr = fdopendir(fd);
+    if (dirptr == NULL)
+      close(fd);
+    return dirptr;
+  }
+#else
+  (void)parent;
+  (void)name;
+#endif
+  return opendir(walk_path.buf);
+}
+
+static int walk_stat(DIR *dirptr, const char *name, struct stat *fileattr)
+{
+#ifdef AT_FDCWD
+  return fstatat(dirfd(dirptr), name, fileattr, 0);
+#else
+  (void)dirptr;
+  (void)name;
+  return stat(walk_path.buf, fileattr);
+#endif
+}
+
+static int walk_dir(DIR *dirptr)
+{
+  const char     *name;
+  char          **sorted       = NULL;
+  size_t          pos          = 0;
+  size_t          dir_name_len = walk_path.len;
+  DIR            *subdir;
+  struct stat     fstat;
+  int             err          = 0;
+
+#ifdef DEBUG
+  printf("Checking directory <%s>\n",walk_path.buf);
+#endif
+
+  /* checkpoints and plans need a walk order that is repeatable */
+  if (checkpoint_file != NULL || plan_out != NULL) {
+    sorted = read_sorted_dir(dirptr);
+    if (sorted == NULL) {
+      fprintf(stderr, "proc_dir_list: Can't allocate enough space; errno=%d\n", errno);
+      return 1;
+    }
+  }
+
+  while (!stop_scan && (name = next_dir_entry(dirptr, sorted, &pos)) != NULL) {
+    /* readdir give us everything and not necessarily in order. This
+       logic is just silly, but it works */
+    if ((strcmp(name, ".") == 0) ||
+        (strcmp(name, "..") == 0))
+      continue;
+
+    if (walk_path_add(name) < 0)
+      break;
+    err = walk_stat(dirptr, name, &fstat);
+
+    if (err == -1) {
+      if (errno == ENOENT) {
+        fprintf(stderr, "proc_dir_list: file %s not found, can't stat\n", walk_path.buf);
+      } else {
+        fprintf(stderr, "proc_dir_list: Cannot stat file %s; errno=%d\n", walk_path.buf, errno);
+      }
+      free(sorted);
+      walk_path.buf[walk_path.len = dir_name_len] = '\0';
+      return 1;
+    }
+    if ((fstat.st_mode & S_IFMT) == S_IFDIR) {
+      if (walk_path_add("/") == 0 && !resume_skip(walk_path.buf, 1)) {
+        subdir = walk_opendir(dirptr, name);
+        if (subdir == NULL) {
+          fprintf(stderr, "proc_dir_list: Can't open dir %s; errno=%d\n", walk_path.buf, errno);
+        } else {
+          walk_dir(subdir);
+          closedir(subdir);
+        }
+      }
+    } else if ((fstat.st_size > 0) && ((fstat.st_mode & S_IFMT) == S_IFREG)) {
+      if (is_allowed_file_type(walk_path.buf) == 0 && !resume_skip(walk_path.buf, 0)) {
+        note_file_stat(&fstat);
+        /* a file scanned right away is opened relative to its directory */
+        if (plan_out == NULL && scan_order == ORDER_WALK) {
+          walk_dir_fd = dirfd(dirptr);
+          walk_name   = name;
+        }
+        dispatch_file(walk_path.buf, &fstat);
+        walk_name = NULL;
+      }
+    }
+    walk_path.buf[walk_path.len = dir_name_len] = '\0';
+  }
+
+  free(sorted);
+  return 0;
+}
+
+static int proc_dir_list(const char *instr)
+{
+  DIR  *dirptr;
+  int   ret;
+
+  if (instr == NULL)
+    return 1;
+
+  walk_path.len = 0;
+  if (walk_path_add(instr) < 0)
+    return 1;
+  dirptr = walk_opendir(NULL, instr);
+  if (dirptr == NULL) {
+    fprintf(stderr, "proc_dir_list: Can't open dir %s; errno=%d\n", instr, errno);
+    return 1;
+  }
+  ret = walk_dir(dirptr);
+  closedir(dirptr);
+  return ret;
+}
+
+static void cleanup_shtuff(int ignored)
+{
+  (void)ignored;
+  time_t end_time = time(NULL);
+  printf("\n\nFiles searched ->\t\t%ld\n", file_count);
+  printf("Search time (seconds) ->\t%ld\n", ((int)time(NULL) - init_time));
+  printf("Credit card matches->\t\t%ld\n", total_count);
+  if (tracksrch)
+    printf("Track data pattern matches->\t%d\n\n", trackdatacount);
+  if (deadline != 0) {
+    printf("Files not reached ->\t\t%ld\n", unreached_count);
+    printf("Files cut short ->\t\t%ld\n", partial_count);
+  }
+  if (cache_file != NULL)
+    printf("Files skipped by cache ->\t%ld\n", cache_skipped);
+  if (pool.limit != 0)
+    printf("Memory in use (KB) ->\t\t%lu, peak %lu\n", (unsigned long)(pool.used >> 10),
+           (unsigned long)(pool.peak >> 10));
+  if (unreached_out != NULL)
+    fclose(unreached_out);
+  if (triage_mode) {
+    printf("Files confirmed ->\t\t%ld\n", triage_confirmed);
+    printf("Files sampled, clean ->\t\t%ld\n", triage_sampled);
+    printf("Files fully scanned, clean ->\t%ld\n", triage_clean);
+    printf("Files unreadable ->\t\t%ld\n", triage_unreadable);
+  }
+  printf("\nLocal end time: %s\n\n", asctime(localtime(&end_time)));
+  if (ignore)
+    free(ignore);
+  if (logfilefd != NULL)
+    fclose(logfilefd);
+  exit(0);
+}
+
+/*
+ * Signals only ask the scan to stop: the walk drains out of the current
+ * file and main() writes the checkpoint and totals. A second signal gives
+ * up on that and exits straight away.
+ */
+static void signal_stop(int sig)
+{
+  if (stop_scan)
+    _exit(1);
+  stop_scan = 1;
+  signal(sig, signal_stop);
+}
+
+static void signal_proc()
+{
+  signal(SIGHUP,  signal_stop);
+  signal(SIGTERM, signal_stop);
+  signal(SIGINT,  signal_stop);
+  signal(SIGQUIT, signal_stop);
+}
+
+static void usage(const char *progname)
+{
+  printf("%s\n", PROG_VER);
+  printf("Usage: %s <options> <start path>\n", progname);
+  printf("  where <options> are:\n");
+  printf("    -D\t\t   Take directory paths to scan from stdin\n");
+  printf("    -F\t\t   Take filenames to scan from stdin\n");
+  printf("    -0\t\t   Names from stdin end with a NUL, not a newline (find -print0)\n");
+  printf("    -C\t\t   CSV output\n");
+  printf("    -a\t\t   Limit to ascii files.\n");
+  printf("    -b\t\t   Add the byte offset into the file of the number\n");
+  printf("    -e\t\t   Include the Modify Access and Create times in terms \n\t\t   of seconds since the epoch\n");
+  printf("    -f\t\t   Only print the filename w/ potential PAN data\n");
+  printf("    -i <filename>  Ignore credit card numbers in this list (test cards)\n");
+  printf("    -j\t\t   Include the Modify Access and Create times in terms \n\t\t   of normal date/time\n");
+  printf("    -o <filename>  Output the data to the file <filename> vs. standard out\n");
+  printf("    -t <1 or 2>\t   Check if the pattern follows either a Track 1 \n\t\t   or 2 format\n");
+  printf("    -T\t\t   Check for both Track 1 and Track 2 patterns\n");
+  printf("    -c\t\t   Show a count of hits per file (only when using -o)\n");
+  printf("    -s\t\t   Show live status information (only when using -o)\n");
+  printf("    -l N\t   Limits the number of results from a single file before going\n\t\t   on to the next file.\n");
+  printf("    -n <list>      File extensions to exclude (i.e .dll,.exe)\n");
+  printf("    -m\t\t   Mask the PAN number.\n");
+  printf("    -h\t\t   Usage information\n");
+  printf("    --checkpoint <file>\n\t\t   Save scan progress to <file> so it can be resumed\n");
+  printf("    --checkpoint-interval N\n\t\t   Seconds between checkpoints (default 60)\n");
+  printf("    --resume\t   Continue from the --checkpoint file; use the same\n\t\t   options and start path as the interrupted scan\n");
+  printf("    --make-plan <file>\n\t\t   List the files to scan and their sizes in <file>\n\t\t   instead of scanning them\n");
+  printf("    --plan <file>  Scan the files listed in a plan instead of a start path\n");
+  printf("    --shard i/N\t   With --plan, scan only the i-th of N equal byte shares\n");
+  printf("    --gentle\t   Keep the page cache and atimes as they were: open with\n\t\t   O_NOATIME where allowed and drop scanned pages from the cache\n");
+  printf("    --direct\t   As --gentle, and read files over 8MB with O_DIRECT\n");
+  printf("    --rate-mb N\t   Read at most N megabytes per second\n");
+  printf("    --rate-files N Scan at most N files per second\n");
+  printf("    --rate-opens N Open at most N files per second\n");
+  printf("    --idle-io\t   Only use the disk when nothing else wants it (Linux)\n");
+  printf("    --nice N\t   Add N to the process nice level\n");
+  printf("    --adaptive-ms N\n\t\t   Back off while reads take longer than N milliseconds\n");
+  printf("    --order <inode|extent>\n\t\t   Scan each batch of files in inode or on-disk order\n");
+  printf("    --batch N\t   Files per --order batch (default 4096)\n");
+  printf("    --triage\t   Report each file once as CONFIRMED, SAMPLED_CLEAN, CLEAN\n\t\t   or UNREADABLE, stopping at its first hit\n");
+  printf("    --sample-over N\n\t\t   In triage, only sample files over N MB (default 256)\n");
+  printf("    --sample-blocks N\n\t\t   1MB blocks sampled between head and tail (default 16)\n");
+  printf("    --priority <file>\n\t\t   Scan the files the weights in <file> rank highest first;\n\t\t   \"default\" uses built-in weights\n");
+  printf("    --deadline <N[m|h] or HH:MM>\n\t\t   Stop scanning after N seconds or at HH:MM and list the\n\t\t   files not reached\n");
+  printf("    --unreached <file>\n\t\t   Write the files not reached to <file> instead of the output\n");
+  printf("    --prefetch K   Ask for the next K files from -F (or a batch) ahead of time\n");
+  printf("    --track-only   Look only for whole track 1 and 2 data (with -t to pick one)\n");
+  printf("    --cache <file>\n\t\t   Keep the hits of each file by content hash in <file>, and\n\t\t   only hash files already in it\n");
+  printf("    --cache-trust-sample\n\t\t   Take a file as cached on its size and sampled hash alone\n");
+  printf("    --json\t   Write JSON Lines with a fixed set of fields\n");
+  printf("    --binary\t   Write a compact binary log to the -o file\n");
+  printf("    --convert <file>\n\t\t   Turn a binary log into JSON Lines, or CSV with -C\n");
+  printf("    --raw\t   Scan the paths given as disk images, end to end;\n\t\t   block devices always are\n");
+  printf("    --workers N\t   Split a device or image, or --pid regions, among N processes\n");
+  printf("    --pid <pid,...|all>\n\t\t   Scan the memory of running processes (Linux)\n");
+  printf("    --max-memory N\n\t\t   Keep buffers and tables within N MB (or NK, NG), scanning\n\t\t   sooner and keeping less instead of growing\n");
+  printf("    --huge-pages   Put the read buffers in huge pages where possible\n");
+  printf("    --owner-map <dir>\n\t\t   Name the file holding each hit on a device, from the\n\t\t   extents of the files of the filesystem mounted at <dir>\n");
+  printf("    --aggregate\t   At the end, list each distinct number by keyed hash with\n\t\t   its hits, and the hits per directory\n");
+  printf("    --aggregate-only\n\t\t   As --aggregate, without the line per hit\n");
+  printf("    --aggregate-key <hex>\n\t\t   32 hex digit key for the hashes (default: random)\n");
+  printf("    --aggregate-max N\n\t\t   Beyond N distinct numbers only estimate the count\n\t\t   (default 1000000)\n\n");
+  printf("See https://github.com/adamcaudill/ccsrch for more information.\n\n");
+  exit(0);
+}
+
+static int open_logfile()
+{
+  if (logfilename != NULL) {
+    logfilefd = fopen(logfilename, output_format == FORMAT_BINARY ? "ab+" : "a+");
+    if (logfilefd == NULL) {
+      fprintf(stderr, "Unable to open logfile %s for writing; errno=%d\n", logfilename, errno);
+      return -1;
+    }
+    fseek(logfilefd, 0, SEEK_END);
+    done.log_offset = ftell(logfilefd);
+    if (output_format == FORMAT_BINARY) {
+      /* hits come in bulk; write them in big blocks */
+      setvbuf(logfilefd, NULL, _IOFBF, 1024 * 1024);
+      if (done.log_offset == 0)
+        fwrite(BINARY_MAGIC, 1, strlen(BINARY_MAGIC), logfilefd);
+    }
+  }
+  return 0;
+}
+
+static unsigned long long bin_get(const unsigned char **p, int bytes)
+{
+  unsigned long long value = 0;
+  int                i;
+
+  for (i=0; i<bytes; i++)
+    value |= (unsigned long long)(*p)[i] << (8 * i);
+  *p += bytes;
+  return value;
+}
+
+/*
+ * Copy a string field out of a record, if it fits in what is left, into
+ * a buffer grown to fit.
+ */
+static int bin_get_str(const unsigned char **p, const unsigned char *end, int len_bytes,
+                       char **str, size_t *size)
+{
+  size_t  len;
+  void   *tmp;
+
+  if (*p + len_bytes > end)
+    return -1;
+  len = bin_get(p, len_bytes);
+  if (len > (size_t)(end - *p))
+    return -1;
+  if (len + 1 > *size) {
+    tmp = realloc(*str, len + 1);
+    if (tmp == NULL)
+      return -1;
+    *str  = (char *)tmp;
+    *size = len + 1;
+  }
+  memcpy(*str, *p, len);
+  (*str)[len] = '\0';
+  *p += len;
+  return 0;
+}
+
+/*
+ * --convert: turn a binary hit log back into JSON Lines, or CSV with -C
+ * (a header, then file,type,pan,offset,mtime,atime,ctime,track,owner,
+ * status, with the fields that don't apply left empty).
+ */
+static int convert_log(const char *filename)
+{
+  FILE                *in;
+  FILE                *out = logfilefd != NULL ? logfilefd : stdout;
+  unsigned char        lenbuf[4];
+  unsigned char       *rec = NULL;
+  const unsigned char *p;
+  const unsigned char *end;
+  char                 magic[8];
+  char                *str[4]  = { NULL, NULL, NULL, NULL };   /* file, type, pan, owner */
+  size_t               size[4] = { 0, 0, 0, 0 };
+  size_t               rec_size = 0;
+  void                *tmp;
+  char                 num[4][32];
+  long                 mtime = 0;
+  long                 atime = 0;
+  long                 c_time = 0;
+  long                 offset;
+  int                  track;
+  size_t               len;
+  long                 records = 0;
+  int                  err = 0;
+  int                  i;
+
+  in = fopen(filename, "rb");
+  if (in == NULL) {
+    fprintf(stderr, "convert_log: Unable to open %s; errno=%d\n", filename, errno);
+    return -1;
+  }
+  if (fread(magic, 1, sizeof magic, in) != sizeof magic ||
+      memcmp(magic, BINARY_MAGIC, sizeof magic) != 0) {
+    fprintf(stderr, "convert_log: %s is not a ccsrch binary log\n", filename);
+    fclose(in);
+    return -1;
+  }
+  if (print_csv)
+    fputs("file,type,pan,offset,mtime,atime,ctime,track,owner,status\n", out);
+
+  while (err == 0 && fread(lenbuf, 1, 4, in) == 4) {
+    p   = lenbuf;
+    len = bin_get(&p, 4);
+    if (len > rec_size) {
+      tmp = realloc(rec, len);
+      if (tmp == NULL) {
+        fprintf(stderr, "convert_log: can't allocate memory; errno=%d\n", errno);
+        err = -1;
+        break;
+      }
+      rec      = (unsigned char *)tmp;
+      rec_size = len;
+    }
+    if (len == 0 || fread(rec, 1, len, in) != len) {
+      err = -1;
+      break;
+    }
+    p   = rec + 1;
+    end = rec + len;
+    switch (rec[0]) {
+      case 'F':
+        if (p + 24 > end) {
+          err = -1;
+          break;
+        }
+        mtime = (long)bin_get(&p, 8);
+        atime = (long)bin_get(&p, 8);
+        c_time = (long)bin_get(&p, 8);
+        err   = bin_get_str(&p, end, 4, &str[0], &size[0]);
+        break;
+      case 'H':
+        if (p + 9 > end) {
+          err = -1;
+          break;
+        }
+        offset = (long)bin_get(&p, 8);
+        track  = (int)bin_get(&p, 1);
+        if (str[0] == NULL || bin_get_str(&p, end, 1, &str[1], &size[1]) < 0 ||
+            bin_get_str(&p, end, 1, &str[2], &size[2]) < 0 ||
+            bin_get_str(&p, end, 2, &str[3], &size[3]) < 0) {
+          err = -1;
+          break;
+        }
+        if (!print_csv) {
+          json_hit(out, str[0], str[1], str[2], offset, mtime, atime, c_time,
+                   track == 1 ? "TRACK_1" : track == 2 ? "TRACK_2" : NULL,
+                   str[3][0] != '\0' ? str[3] : NULL);
+          break;
+        }
+        snprintf(num[0], sizeof num[0], "%ld", offset);
+        snprintf(num[1], sizeof num[1], "%ld", mtime);
+        snprintf(num[2], sizeof num[2], "%ld", atime);
+        snprintf(num[3], sizeof num[3], "%ld", c_time);
+        csv_field(out, str[0], 0);
+        csv_field(out, str[1], 0);
+        csv_field(out, str[2], 0);
+        csv_field(out, num[0], 0);
+        csv_field(out, num[1], 0);
+        csv_field(out, num[2], 0);
+        csv_field(out, num[3], 0);
+        csv_field(out, track == 1 ? "TRACK_1" : track == 2 ? "TRACK_2" : NULL, 0);
+        csv_field(out, str[3], 0);
+        csv_field(out, NULL, 1);
+        break;
+      case 'S':
+        if (bin_get_str(&p, end, 1, &str[1], &size[1]) < 0 ||
+            bin_get_str(&p, end, 4, &str[2], &size[2]) < 0) {
+          err = -1;
+          break;
+        }
+        if (print_csv) {
+          csv_field(out, str[2], 0);
+          fputs(",,,,,,,,", out);
+          csv_field(out, str[1], 1);
+        } else {
+          json_status(out, str[2], str[1]);
+        }
+        break;
+      default:
+        /* a kind from a later version; its length lets us step over it */
+        break;
+    }
+    records++;
+  }
+  if (err != 0)
+    fprintf(stderr, "convert_log: %s is damaged after %ld records\n", filename, records);
+  free(rec);
+  for (i=0; i<4; i++)
+    free(str[i]);
+  fclose(in);
+  return err;
+}
+
+static int check_dir(const char *name)
+{
+  DIR *dirptr;
+
+  dirptr = opendir(name);
+  if (dirptr!=NULL) {
+    closedir(dirptr);
+    return 1;
+  } else {
+    return 0;
+  }
+}
+
+static char *read_ignore_list(const char *filename, size_t *len)
+{
+  char  *buf;
+  FILE  *infile;
+
+  infile = fopen(filename, "r");
+  if (!infile)
+    return NULL;
+
+  fseek(infile, 0, SEEK_END);
+  *len = ftell(infile);
+  fseek(infile, 0, SEEK_SET);
+  buf = malloc(*len+1);
+  if (buf == NULL)
+    return NULL;
+
+  if (fread(buf, 1, *len, infile) == 0)
+    fprintf(stderr, "Error with reading buf from %s\n", filename);
+  fclose(infile);
+  return buf;
+}
+
+static void split_ignore_list(char *buf, size_t len)
+{
+  size_t i;
+  for (i=0; i<len; i++) {
+    if (buf[i] == '\n')
+      buf[i] = ' ';
+  }
+}
+
+static void chomp(char *buf)
+{
+  int b;
+  for (;;) {
+    b = *buf;
+    if (b == '\0')
+      return;
+    if (b == '\n' || b == '\r') {
+      *buf = '\0';
+      return;
+    }
+    buf++;
+  }
+}
+
+/*
+ * Read one path from stdin for -D or -F, up to a newline (or a NUL with
+ * -0, for names that may hold newlines) into a buffer grown as needed.
+ * Two zero bytes follow the path, as scanpath() may append a '/'.
+ * Returns 0 at the end of the input.
+ */
+static int read_input_path(char **buf, size_t *size)
+{
+  size_t  len = 0;
+  int     c;
+  void   *tmp;
+
+  while ((c = getchar()) != EOF && c != input_delim) {
+    if (len + 2 >= *size) {
+      tmp = pool_resize(*buf, *size, *size * 2 + 256);
+      if (tmp == NULL) {
+        fprintf(stderr, "read_input_path: can't allocate memory; errno=%d\n", errno);
+        return 0;
+      }
+      *buf  = (char *)tmp;
+      *size = *size * 2 + 256;
+    }
+    (*buf)[len++] = (char)c;
+  }
+  if (len == 0 && c == EOF)
+    return 0;
+  if (*buf == NULL) {
+    *buf = (char *)pool_calloc(1, 256);
+    if (*buf == NULL)
+      return 0;
+    *size = 256;
+  }
+  (*buf)[len]     = '\0';
+  (*buf)[len + 1] = '\0';
+  if (input_delim == '\n')
+    chomp(*buf);
+  return 1;
+}
+
+/*
+ * The paths read from stdin, kept prefetch_window ahead of the one being
+ * scanned so that files can be prefetched as they are queued.
+ */
+static struct {
+  char    **paths;
+  size_t   *sizes;
+  int       slots;
+  int       head;
+  int       queued;
+  int       handed_out;
+  long      read;       /* paths read so far, to skip those resumed past */
+  int       eof;
+} input_queue;
+
+static char *next_input_path(void)
+{
+  /* a batch prefetches in its own order, so -F only does when there is none */
+  int ahead = files_from_stdin && scan_order == ORDER_WALK && plan_out == NULL;
+  int slot;
+
+  if (input_queue.paths == NULL) {
+    input_queue.slots = ahead ? prefetch_window + 1 : 1;
+    input_queue.paths = (char **)pool_calloc(input_queue.slots, sizeof(char *));
+    input_queue.sizes = (size_t *)pool_calloc(input_queue.slots, sizeof(size_t));
+    if (input_queue.paths == NULL || input_queue.sizes == NULL) {
+      fprintf(stderr, "next_input_path: can't allocate memory; errno=%d\n", errno);
+      return NULL;
+    }
+  }
+  /* the slot handed out last time is free again */
+  if (input_queue.handed_out) {
+    input_queue.head = (input_queue.head + 1) % input_queue.slots;
+    input_queue.queued--;
+    input_queue.handed_out = 0;
+  }
+  /* near the memory budget, read no further ahead than needed */
+  while (!input_queue.eof && input_queue.queued < input_queue.slots &&
+         (input_queue.queued == 0 || !pool_tight())) {
+    slot = (input_queue.head + input_queue.queued) % input_queue.slots;
+    if (!read_input_path(&input_queue.paths[slot], &input_queue.sizes[slot])) {
+      input_queue.eof = 1;
+      break;
+    }
+    if (input_queue.paths[slot][0] == '\0')
+      continue;
+    if (ahead && input_queue.read >= resume_input)
+      prefetch_file(input_queue.paths[slot]);
+    input_queue.read++;
+    input_queue.queued++;
+  }
+  if (input_queue.queued == 0)
+    return NULL;
+  input_queue.handed_out = 1;
+  return input_queue.paths[input_queue.head];
+}
+
+#ifdef FS_IOC_FIEMAP
+static int owner_extent_cmp(const void *a, const void *b)
+{
+  const struct owner_extent *x = (const struct owner_extent *)a;
+  const struct owner_extent *y = (const struct owner_extent *)b;
+
+  return x->physical < y->physical ? -1 : x->physical > y->physical;
+}
+
+/* Add all of a file's extents with a known place on the disk. */
+static void map_file_extents(const char *filename)
+{
+  static struct fiemap *fm = NULL;
+  struct fiemap_extent *fe;
+  unsigned long long    start = 0;
+  size_t                len   = strlen(filename) + 1;
+  size_t                path  = 0;
+  int                   last  = 0;
+  int                   fd;
+  unsigned int          i;
+  void                 *tmp;
+
+  if (fm == NULL) {
+    fm = (struct fiemap *)malloc(sizeof(struct fiemap) + 64 * sizeof(struct fiemap_extent));
+    if (fm == NULL)
+      return;
+  }
+  fd = open(filename, O_RDONLY | O_BINARY);
+  if (fd < 0)
+    return;
+
+  if (owner_map.paths_used + len > owner_map.paths_size) {
+    tmp = pool_resize(owner_map.paths, owner_map.paths_size, (owner_map.paths_size + len) * 2);
+    if (tmp == NULL) {
+      close(fd);
+      return;
+    }
+    owner_map.paths      = (char *)tmp;
+    owner_map.paths_size = (owner_map.paths_size + len) * 2;
+  }
+  path = owner_map.paths_used;
+  memcpy(owner_map.paths + path, filename, len);
+  owner_map.paths_used += len;
+
+  while (!last) {
+    memset(fm, 0, sizeof(struct fiemap));
+    fm->fm_start        = start;
+    fm->fm_length       = ~0ULL - start;
+    fm->fm_extent_count = 64;
+    if (ioctl(fd, FS_IOC_FIEMAP, fm) != 0 || fm->fm_mapped_extents == 0)
+      break;
+    for (i=0; i<fm->fm_mapped_extents; i++) {
+      fe    = &fm->fm_extents[i];
+      start = fe->fe_logical + fe->fe_length;
+      if (fe->fe_flags & FIEMAP_EXTENT_LAST)
+        last = 1;
+      if (fe->fe_flags & (FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DATA_INLINE | FIEMAP_EXTENT_ENCODED))
+        continue;
+      if (owner_map.count == owner_map.size) {
+        tmp = pool_resize(owner_map.extents, owner_map.size * sizeof(struct owner_extent),
+                          (owner_map.size * 2 + 1024) * sizeof(struct owner_extent));
+        if (tmp == NULL) {
+          last = 1;
+          break;
+        }
+        owner_map.extents = (struct owner_extent *)tmp;
+        owner_map.size    = owner_map.size * 2 + 1024;
+      }
+      owner_map.extents[owner_map.count].physical = fe->fe_physical;
+      owner_map.extents[owner_map.count].length   = fe->fe_length;
+      owner_map.extents[owner_map.count].path     = path;
+      owner_map.count++;
+    }
+  }
+  close(fd);
+}
+
+/* Walk one filesystem, not crossing into others mounted below it. */
+static void map_owner_dir(char *path, size_t len, dev_t dev)
+{
+  DIR            *dirptr;
+  struct dirent  *direntptr;
+  struct stat     fileattr;
+  size_t          name_len;
+
+  dirptr = opendir(path);
+  if (dirptr == NULL)
+    return;
+  while ((direntptr = readdir(dirptr)) != NULL) {
+    if ((strcmp(direntptr->d_name, ".") == 0) ||
+        (strcmp(direntptr->d_name, "..") == 0))
+      continue;
+    name_len = strlen(direntptr->d_name);
+    if (len + name_len + 2 > MAXPATH)
+      continue;
+    memcpy(path + len, direntptr->d_name, name_len + 1);
+    if (lstat(path, &fileattr) != 0 || fileattr.st_dev != dev)
+      continue;
+    if ((fileattr.st_mode & S_IFMT) == S_IFDIR) {
+      path[len + name_len]     = '/';
+      path[len + name_len + 1] = '\0';
+      map_owner_dir(path, len + name_len + 1, dev);
+    } else if ((fileattr.st_mode & S_IFMT) == S_IFREG && fileattr.st_size > 0) {
+      map_file_extents(path);
+    }
+  }
+  path[len] = '\0';
   closedir(dirptr);
+}
+#endif
+
+static int load_owner_map(const char *root)
+{
+#ifdef FS_IOC_FIEMAP
+  char         path[MAXPATH];
+  size_t       len = strlen(root);
+  struct stat  fileattr;
+
+  if (len + 2 > MAXPATH || stat(root, &fileattr) != 0) {
+    fprintf(stderr, "load_owner_map: Cannot stat %s; errno=%d\n", root, errno);
+    return -1;
+  }
+  snprintf(path, MAXPATH, "%s%s", root, root[len - 1] == '/' ? "" : "/");
+  owner_map.dev = fileattr.st_dev;
+  printf("Mapping the files under %s...\n", root);
+  map_owner_dir(path, strlen(path), fileattr.st_dev);
+  qsort(owner_map.extents, owner_map.count, sizeof(struct owner_extent), owner_extent_cmp);
+  printf("%lu extents mapped\n", (unsigned long)owner_map.count);
   return 0;
+#else
+  fprintf(stderr, "load_owner_map: --owner-map needs FIEMAP, which this system lacks\n");
+  (void)root;
+  return -1;
+#endif
 }
 
-static void cleanup_shtuff(int ignored)
+/* Size of a block device, or of an image file. Character devices are refused before this. */
+static long raw_size(int fd, const struct stat *fileattr)
 {
-  (void)ignored;
-  time_t end_time = time(NULL);
-  printf("\n\nFiles searched ->\t\t%ld\n", file_count);
-  printf("Search time (seconds) ->\t%ld\n", ((int)time(NULL) - init_time));
-  printf("Credit card matches->\t\t%ld\n", total_count);
-  if (tracksrch)
-    printf("Track data pattern matches->\t%d\n\n", trackdatacount);
-  printf("\nLocal end time: %s\n\n", asctime(localtime(&end_time)));
-  if (ignore)
-    free(ignore);
-  if (logfilefd != NULL)
-    fclose(logfilefd);
-  exit(0);
+#ifdef BLKGETSIZE64
+  unsigned long long bytes;
+
+  if ((fileattr->st_mode & S_IFMT) == S_IFBLK && ioctl(fd, BLKGETSIZE64, &bytes) == 0)
+    return (long)bytes;
+#endif
+  if ((fileattr->st_mode & S_IFMT) == S_IFREG)
+    return fileattr->st_size;
+  return lseek(fd, 0, SEEK_END);
+}
+
+struct raw_job {
+  const char *path;
+  long        size;
+};
+
+#ifndef _WIN32
+/*
+ * Aggregate the hits a worker spooled, under the names it found them in.
+ * A name carried on from the last spool counts as the same file.
+ */
+static void replay_spool(FILE *spool)
+{
+  static char     *name[2];
+  static size_t    size[2];
+  static int       cur = 0;
+  struct agg_rec   rec;
+  const char      *saved = currfilename;
+  void            *tmp;
+  int              next;
+  int              i;
+
+  rewind(spool);
+  while (fread(&rec, sizeof rec, 1, spool) == 1) {
+    next = !cur;
+    if (rec.name_len + 1 > size[next]) {
+      tmp = realloc(name[next], rec.name_len + 1);
+      if (tmp == NULL)
+        break;
+      name[next] = (char *)tmp;
+      size[next] = rec.name_len + 1;
+    }
+    if (fread(name[next], 1, rec.name_len, spool) != rec.name_len)
+      break;
+    name[next][rec.name_len] = '\0';
+    rec.type[sizeof rec.type - 1] = '\0';
+    rec.pan[sizeof rec.pan - 1]   = '\0';
+    /* the tables keep the card type by pointer, so use the literal */
+    for (i=0; card_names[i] != NULL && strcmp(card_names[i], rec.type) != 0; i++)
+      ;
+    if (card_names[i] == NULL)
+      continue;
+    if (agg.file_serial == -1 || name[cur] == NULL || strcmp(name[cur], name[next]) != 0) {
+      cur             = next;
+      agg.file_serial = -1;
+    }
+    currfilename = name[cur];
+    aggregate_hit(card_names[i], rec.pan, rec.offset);
+  }
+  currfilename = saved;
+}
+
+/*
+ * Run job(0) .. job(n - 1), each in a child process writing its results
+ * to a temporary file, and put the results out in job order. The hit
+ * counts come back through a shared mapping, and with --aggregate the
+ * hits through a spool file for the parent's tables. Returns -1 if a
+ * job failed.
+ */
+static int run_workers(int n, int (*job)(int, void *), void *arg)
+{
+  FILE  **parts;
+  FILE  **spools;
+  long   *counts;
+  pid_t  *pids;
+  FILE   *out = logfilefd != NULL ? logfilefd : stdout;
+  char    copybuf[BSIZE];
+  size_t  len;
+  int     status;
+  int     ret = 0;
+  int     i;
+
+  parts  = (FILE **)calloc(n, sizeof(FILE *));
+  spools = (FILE **)calloc(n, sizeof(FILE *));
+  pids   = (pid_t *)calloc(n, sizeof(pid_t));
+  counts = (long *)mmap(NULL, 2 * n * sizeof(long), PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (parts == NULL || spools == NULL || pids == NULL || counts == (long *)MAP_FAILED) {
+    fprintf(stderr, "run_workers: can't allocate memory; errno=%d\n", errno);
+    exit(-1);
+  }
+  fflush(NULL);
+  for (i=0; i<n; i++) {
+    parts[i] = tmpfile();
+    if (aggregate_mode)
+      spools[i] = tmpfile();
+    if (parts[i] == NULL || (aggregate_mode && spools[i] == NULL)) {
+      fprintf(stderr, "run_workers: Cannot create a temporary file; errno=%d\n", errno);
+      exit(-1);
+    }
+    pids[i] = fork();
+    if (pids[i] < 0) {
+      fprintf(stderr, "run_workers: Cannot fork; errno=%d\n", errno);
+      exit(-1);
+    }
+    if (pids[i] == 0) {
+      /* each worker gets its share of what is left of the budget */
+      if (pool.limit != 0 && pool.limit > pool.used)
+        pool.limit = pool.used + (pool.limit - pool.used) / n;
+      logfilefd      = parts[i];
+      agg_spool      = spools[i];
+      total_count    = 0;
+      trackdatacount = 0;
+      ret = job(i, arg);
+      fflush(parts[i]);
+      if (agg_spool != NULL)
+        fflush(agg_spool);
+      counts[2 * i]     = total_count;
+      counts[2 * i + 1] = trackdatacount;
+      _exit(ret < 0 ? 1 : 0);
+    }
+  }
+  for (i=0; i<n; i++) {
+    while (waitpid(pids[i], &status, 0) < 0 && errno == EINTR)
+      ;
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+      ret = -1;
+    rewind(parts[i]);
+    while ((len = fread(copybuf, 1, sizeof copybuf, parts[i])) > 0)
+      fwrite(copybuf, 1, len, out);
+    fclose(parts[i]);
+    if (spools[i] != NULL) {
+      replay_spool(spools[i]);
+      fclose(spools[i]);
+    }
+    total_count    += counts[2 * i];
+    trackdatacount += (int)counts[2 * i + 1];
+  }
+  /* the next file the parent sees is a new one */
+  agg.file_serial = -1;
+  munmap(counts, 2 * n * sizeof(long));
+  free(parts);
+  free(spools);
+  free(pids);
+  return ret;
+}
+
+/* One --workers share of a device. */
+static int raw_part(int i, void *arg)
+{
+  const struct raw_job *raw = (const struct raw_job *)arg;
+
+  scan_range_lo = raw->size / raw_workers * i;
+  scan_range_hi = i == raw_workers - 1 ? raw->size : raw->size / raw_workers * (i + 1);
+  currfile_size = raw->size;
+  return ccsrch(raw->path);
+}
+#endif
+
+/*
+ * Scan a block device or disk image end to end, unallocated space and
+ * all. Hits are reported with their offset from the start of the device.
+ * With --workers the device is cut into that many ranges, each scanned
+ * by a child process; the ranges overlap as in a shard, and the results
+ * are put out in device order.
+ */
+static int scan_raw(const char *path, const struct stat *fileattr)
+{
+  struct raw_job raw;
+  int    fd;
+  int    saved_offset = print_byte_offset;
+  int    ret          = 0;
+
+  if ((fileattr->st_mode & S_IFMT) == S_IFCHR) {
+    fprintf(stderr, "scan_raw: %s is a character device, whose size can't be found; give the block device\n", path);
+    return -1;
+  }
+  /* FIEMAP offsets are from the start of the filesystem's own device */
+  if (owner_map_root != NULL && (fileattr->st_mode & S_IFMT) == S_IFBLK &&
+      fileattr->st_rdev != owner_map.dev) {
+    fprintf(stderr, "scan_raw: %s does not hold the filesystem at %s; --owner-map needs its partition\n",
+            path, owner_map_root);
+    return -1;
+  }
+  fd = open_scan_file(path);
+  if (fd < 0) {
+    fprintf(stderr, "scan_raw: Unable to open %s for reading; errno=%d\n", path, errno);
+    return -1;
+  }
+  raw.path = path;
+  raw.size = raw_size(fd, fileattr);
+  close(fd);
+  if (raw.size <= 0) {
+    fprintf(stderr, "scan_raw: Cannot find the size of %s; errno=%d\n", path, errno);
+    return -1;
+  }
+
+  print_byte_offset = 1;
+  raw_scanning      = 1;
+  currfile_atime    = fileattr->st_atime;
+  currfile_mtime    = fileattr->st_mtime;
+  currfile_ctime    = fileattr->st_ctime;
+
+#ifndef _WIN32
+  if (raw_workers > 1 && raw.size / raw_workers > RANGE_OVERLAP) {
+    ret = run_workers(raw_workers, raw_part, &raw);
+    file_count++;
+  } else
+#endif
+  {
+    currfile_size = raw.size;
+    ret = ccsrch(path);
+  }
+  scan_range_lo     = 0;
+  scan_range_hi     = -1;
+  raw_scanning      = 0;
+  print_byte_offset = saved_offset;
+  return ret;
 }
 
-static void signal_proc()
+#ifdef __linux__
+/*
+ * --pid: scan the memory of running processes. The regions worth looking
+ * at are taken from /proc/<pid>/maps: readable, private, and either
+ * anonymous (heap, stacks, arenas) or writable. Read-only file mappings
+ * are left out, as they hold what is in the file on disk. The regions are
+ * read with process_vm_readv(), many at a time, into the read buffer
+ * with a gap after each so the checks can peek past the end. Each hit is
+ * reported under a name giving the pid, command and region, with its
+ * virtual address as the offset. Needs the right to ptrace the process.
+ */
+#define MEM_IOV   1024
+#define MEM_SPLIT (16 * 1024 * 1024)
+
+/*
+ * A region, or a MEM_SPLIT piece of a large one so that --workers can
+ * share it out. Like a shard, a piece is read a little either side of
+ * the part it reports hits for.
+ */
+struct mem_region {
+  pid_t          pid;
+  unsigned long  start;         /* what is read */
+  unsigned long  end;
+  unsigned long  lo;            /* where its hits may start */
+  unsigned long  hi;
+  char          *name;
+};
+
+static struct {
+  struct mem_region  *list;
+  size_t              count;
+  size_t              size;
+  unsigned long long  bytes;
+  long                regions;
+  long                processes;
+} mem;
+
+static int add_mem_region(pid_t pid, const char *comm, unsigned long start, unsigned long end,
+                          const char *path)
 {
-  signal(SIGHUP,  cleanup_shtuff);
-  signal(SIGTERM, cleanup_shtuff);
-  signal(SIGINT,  cleanup_shtuff);
-  signal(SIGQUIT, cleanup_shtuff);
+  struct mem_region *region;
+  unsigned long      lo;
+  char              *name;
+  size_t             len;
+  void              *tmp;
+
+  len  = strlen(comm) + strlen(path) + 96;
+  name = (char *)pool_calloc(1, len);
+  if (name == NULL)
+    return -1;
+  snprintf(name, len, "pid %d (%s) %s %lx-%lx", (int)pid, comm,
+           *path != '\0' ? path : "[anon]", start, end);
+  mem.regions++;
+  for (lo=start; lo<end; lo+=MEM_SPLIT) {
+    if (mem.count == mem.size) {
+      tmp = pool_resize(mem.list, mem.size * sizeof(struct mem_region),
+                        (mem.size * 2 + 256) * sizeof(struct mem_region));
+      if (tmp == NULL)
+        return -1;
+      mem.list  = (struct mem_region *)tmp;
+      mem.size  = mem.size * 2 + 256;
+    }
+    region        = &mem.list[mem.count++];
+    region->pid   = pid;
+    region->lo    = lo;
+    region->hi    = end - lo > MEM_SPLIT ? lo + MEM_SPLIT : end;
+    region->start = lo - start > RANGE_OVERLAP ? lo - RANGE_OVERLAP : start;
+    region->end   = end - region->hi > RANGE_OVERLAP ? region->hi + RANGE_OVERLAP : end;
+    region->name  = name;
+    mem.bytes    += region->hi - region->lo;
+  }
+  return 0;
 }
 
-static void usage(const char *progname)
+static int add_process(pid_t pid)
 {
-  printf("%s\n", PROG_VER);
-  printf("Usage: %s <options> <start path>\n", progname);
-  printf("  where <options> are:\n");
-  printf("    -D\t\t   Take directory paths to scan from stdin\n");
-  printf("    -F\t\t   Take filenames to scan from stdin\n");
-  printf("    -C\t\t   CSV output\n");
-  printf("    -a\t\t   Limit to ascii files.\n");
-  printf("    -b\t\t   Add the byte offset into the file of the number\n");
-  printf("    -e\t\t   Include the Modify Access and Create times in terms \n\t\t   of seconds since the epoch\n");
-  printf("    -f\t\t   Only print the filename w/ potential PAN data\n");
-  printf("    -i <filename>  Ignore credit card numbers in this list (test cards)\n");
-  printf("    -j\t\t   Include the Modify Access and Create times in terms \n\t\t   of normal date/time\n");
-  printf("    -o <filename>  Output the data to the file <filename> vs. standard out\n");
-  printf("    -t <1 or 2>\t   Check if the pattern follows either a Track 1 \n\t\t   or 2 format\n");
-  printf("    -T\t\t   Check for both Track 1 and Track 2 patterns\n");
-  printf("    -c\t\t   Show a count of hits per file (only when using -o)\n");
-  printf("    -s\t\t   Show live status information (only when using -o)\n");
-  printf("    -l N\t   Limits the number of results from a single file before going\n\t\t   on to the next file.\n");
-  printf("    -n <list>      File extensions to exclude (i.e .dll,.exe)\n");
-  printf("    -m\t\t   Mask the PAN number.\n");
-  printf("    -h\t\t   Usage information\n\n");
-  printf("See https://github.com/adamcaudill/ccsrch for more information.\n\n");
-  exit(0);
+  FILE          *maps;
+  char           fname[64];
+  char           comm[64] = "";
+  char           perms[8];
+  char          *line = NULL;
+  char          *path;
+  size_t         size = 0;
+  unsigned long  start;
+  unsigned long  end;
+  int            used;
+  int            fd;
+  ssize_t        len;
+
+  snprintf(fname, sizeof fname, "/proc/%d/comm", (int)pid);
+  fd = open(fname, O_RDONLY);
+  if (fd >= 0) {
+    len = read(fd, comm, sizeof comm - 1);
+    comm[len > 0 ? len : 0] = '\0';
+    comm[strcspn(comm, "\n")] = '\0';
+    close(fd);
+  }
+  snprintf(fname, sizeof fname, "/proc/%d/maps", (int)pid);
+  maps = fopen(fname, "r");
+  if (maps == NULL) {
+    fprintf(stderr, "add_process: Unable to read %s; errno=%d\n", fname, errno);
+    return -1;
+  }
+  while (getline(&line, &size, maps) > 0) {
+    line[strcspn(line, "\n")] = '\0';
+    if (sscanf(line, "%lx-%lx %7s %*s %*s %*s %n", &start, &end, perms, &used) != 3)
+      continue;
+    path = line + used;
+    if (perms[0] != 'r' || perms[3] != 'p')
+      continue;
+    if (*path != '\0' && perms[1] != 'w' && *path != '[')
+      continue;
+    /* kernel pages that can't be read this way, or hold nothing of ours */
+    if (strcmp(path, "[vvar]") == 0 || strcmp(path, "[vvar_vclock]") == 0 ||
+        strcmp(path, "[vsyscall]") == 0 || strcmp(path, "[vdso]") == 0)
+      continue;
+    if (add_mem_region(pid, comm, start, end, path) < 0) {
+      fprintf(stderr, "add_process: can't allocate memory; errno=%d\n", errno);
+      break;
+    }
+  }
+  free(line);
+  fclose(maps);
+  mem.processes++;
+  return 0;
 }
 
-static int open_logfile()
+/* The processes in list: pids separated by commas, or "all". */
+static int find_processes(const char *list)
 {
-  if (logfilename != NULL) {
-    logfilefd = fopen(logfilename, "a+");
-    if (logfilefd == NULL) {
-      fprintf(stderr, "Unable to open logfile %s for writing; errno=%d\n", logfilename, errno);
+  DIR           *dir;
+  struct dirent *ent;
+  const char    *p = list;
+  char          *end;
+  long           pid;
+
+  if (strcmp(list, "all") == 0) {
+    dir = opendir("/proc");
+    if (dir == NULL) {
+      fprintf(stderr, "find_processes: Can't open /proc; errno=%d\n", errno);
+      return -1;
+    }
+    while ((ent = readdir(dir)) != NULL) {
+      pid = strtol(ent->d_name, &end, 10);
+      if (*end == '\0' && pid > 0 && pid != (long)getpid())
+        add_process((pid_t)pid);
+    }
+    closedir(dir);
+    return 0;
+  }
+  while (*p != '\0') {
+    pid = strtol(p, &end, 10);
+    if (end == p || pid <= 0 || (*end != ',' && *end != '\0')) {
+      fprintf(stderr, "find_processes: Bad pid list %s\n", list);
       return -1;
     }
+    add_process((pid_t)pid);
+    p = *end == ',' ? end + 1 : end;
   }
   return 0;
 }
 
-static int check_dir(const char *name)
+/* Feed n bytes of a region to the checks. Returns 1 to give up on it. */
+static int scan_mem(char *data, long n)
 {
-  DIR *dirptr;
+  long pos;
+  long len;
+  int  ret = 0;
 
-  dirptr = opendir(name);
-  if (dirptr!=NULL) {
-    closedir(dirptr);
-    return 1;
-  } else {
-    return 0;
+  bucket_take(&byte_bucket, n);
+  for (pos=0; pos<n && ret == 0; pos+=len) {
+    len = n - pos < BSIZE - 1 || track_mode ? n - pos : BSIZE - 1;
+    ccsrch_buf = data + pos;
+    ret = track_mode ? track_feed(ccsrch_buf, len) : scan_chunk(len);
   }
+  return ret;
 }
 
-static char *read_ignore_list(const char *filename, size_t *len)
+static void end_region(int skip)
 {
-  char  *buf;
-  FILE  *infile;
+  if (track_mode && !skip)
+    track_feed(NULL, 0);
+}
 
-  infile = fopen(filename, "r");
-  if (!infile)
-    return NULL;
+/*
+ * Scan regions [first, last) of the list. Each process_vm_readv() call
+ * fills the read buffer from as many regions of one process as fit. A
+ * read stops at the first page that can't be read (unmapped since maps
+ * was read, or guard pages); that page is skipped and the checks start
+ * afresh after it.
+ */
+static int scan_regions(size_t first, size_t last)
+{
+  static struct iovec  local[MEM_IOV];
+  static struct iovec  remote[MEM_IOV];
+  static size_t        owner[MEM_IOV];
+  struct mem_region   *region;
+  unsigned long        at;
+  unsigned long        next_at;
+  long                 page = sysconf(_SC_PAGESIZE);
+  long                 pos;
+  long                 len;
+  ssize_t              got;
+  size_t               next;
+  size_t               r    = first;
+  pid_t                pid;
+  int                  skip = 0;
+  int                  n;
+  int                  i;
 
-  fseek(infile, 0, SEEK_END);
-  *len = ftell(infile);
-  fseek(infile, 0, SEEK_SET);
-  buf = malloc(*len+1);
-  if (buf == NULL)
-    return NULL;
+  if (r < last)
+    at = mem.list[r].start;
+  while (r < last && !stop_scan && !check_deadline()) {
+    pid     = mem.list[r].pid;
+    next    = r;
+    next_at = at;
+    pos     = 0;
+    for (n=0; n<MEM_IOV && next<last && mem.list[next].pid == pid && pos<IOBUFSIZE; n++) {
+      len = mem.list[next].end - next_at;
+      if (len > IOBUFSIZE - pos)
+        len = IOBUFSIZE - pos;
+      local[n].iov_base  = io_buf + pos;
+      local[n].iov_len   = len;
+      remote[n].iov_base = (void *)next_at;
+      remote[n].iov_len  = len;
+      owner[n]           = next;
+      pos     += len + IOPAD;
+      next_at += len;
+      if (next_at == mem.list[next].end && ++next < last)
+        next_at = mem.list[next].start;
+    }
 
-  if (fread(buf, 1, *len, infile) == 0)
-    fprintf(stderr, "Error with reading buf from %s\n", filename);
-  fclose(infile);
-  return buf;
+    got = syscall(SYS_process_vm_readv, pid, local, n, remote, n, 0);
+    if (got < 0 && errno != EFAULT) {
+      if (errno != ESRCH)
+        fprintf(stderr, "scan_regions: Unable to read the memory of pid %d; errno=%d\n", (int)pid, errno);
+      while (r < last && mem.list[r].pid == pid)
+        r++;
+      if (r < last)
+        at = mem.list[r].start;
+      continue;
+    }
+    if (got < 0)
+      got = 0;
+
+    for (i=0; i<n; i++) {
+      region = &mem.list[owner[i]];
+      len    = got < (ssize_t)local[i].iov_len ? got : (ssize_t)local[i].iov_len;
+      got   -= len;
+      if ((unsigned long)remote[i].iov_base == region->start) {
+        currfilename   = region->name;
+        file_hit_count = 0;
+        /* file_count doesn't move between regions, so mark a new name for --aggregate */
+        if (region == mem.list || region[-1].name != region->name)
+          agg.file_serial = -1;
+        skip           = 0;
+        scan_range_lo  = region->lo;
+        scan_range_hi  = region->hi;
+        scan_reset(region->start);
+      }
+      memset((char *)local[i].iov_base + len, '\0', IOPAD);
+      if (!skip && len > 0)
+        skip = scan_mem((char *)local[i].iov_base, len);
+      if (len < (long)local[i].iov_len) {
+        /* go on after the page that couldn't be read */
+        at = ((unsigned long)remote[i].iov_base + len) / page * page + page;
+        r  = owner[i];
+        if (at >= region->end) {
+          end_region(skip);
+          if (++r < last)
+            at = mem.list[r].start;
+        } else {
+          scan_reset(at);
+        }
+        break;
+      }
+      if ((unsigned long)remote[i].iov_base + len == region->end)
+        end_region(skip);
+    }
+    if (i == n) {
+      r  = next;
+      at = next_at;
+    }
+  }
+  return 0;
 }
 
-static void split_ignore_list(char *buf, size_t len)
+/* One --workers share of the regions, by bytes. */
+static int mem_part(int i, void *arg)
 {
-  size_t i;
-  for (i=0; i<len; i++) {
-    if (buf[i] == '\n')
-      buf[i] = ' ';
-  }
+  unsigned long long  from = mem.bytes / raw_workers * i;
+  unsigned long long  to   = i == raw_workers - 1 ? mem.bytes : mem.bytes / raw_workers * (i + 1);
+  unsigned long long  sum  = 0;
+  size_t              first;
+  size_t              last;
+
+  (void)arg;
+  /* a piece goes to the worker whose share it starts in */
+  for (first=0; first<mem.count && sum < from; first++)
+    sum += mem.list[first].hi - mem.list[first].lo;
+  for (last=first; last<mem.count && sum < to; last++)
+    sum += mem.list[last].hi - mem.list[last].lo;
+  return scan_regions(first, last);
 }
 
-static void chomp(char *buf)
+static int scan_processes(const char *list)
 {
-  int b;
-  for (;;) {
-    b = *buf;
-    if (b == '\0')
-      return;
-    if (b == '\n' || b == '\r') {
-      *buf = '\0';
-      return;
-    }
-    buf++;
-  }
+  int saved_offset = print_byte_offset;
+  int ret;
+
+  if (find_processes(list) < 0)
+    return 0;
+  printf("Scanning %ld regions, %llu MB, of %ld processes\n", mem.regions, mem.bytes >> 20,
+         mem.processes);
+  print_byte_offset = 1;
+  mem_scanning      = 1;
+  currfile_atime    = currfile_mtime = currfile_ctime = time(NULL);
+  if (raw_workers > 1 && mem.count > 1)
+    ret = run_workers(raw_workers, mem_part, NULL);
+  else
+    ret = scan_regions(0, mem.count);
+  file_count       += mem.processes;
+  scan_range_lo     = 0;
+  scan_range_hi     = -1;
+  mem_scanning      = 0;
+  print_byte_offset = saved_offset;
+  return ret == 0;
 }
+#endif
 
 int scanpath(char *inbuf)
 {
   struct stat	ffstat;
   int         err            = 0;
-  char        tmpbuf[BSIZE];
 
   if (check_dir(inbuf)) {
 #ifdef WINDOWS
@@ -895,25 +5044,13 @@ int scanpath(char *inbuf)
       return 0;
     }
 
-    if ((ffstat.st_size > 0) && ((ffstat.st_mode & S_IFMT) == S_IFREG)) {
-      memset(&tmpbuf, '\0', BSIZE);
-      if (escape_space(inbuf, tmpbuf) == 0) {
-        if (logfilename != NULL) {
-          if (strstr(inbuf, logfilename) != NULL) {
-            fprintf(stderr, "main: We seem to be hitting our log file, so we'll leave this out of the search -> %s\n", inbuf);
-          } else {
-#ifdef DEBUG
-            printf("Processing file %s\n",inbuf);
-#endif
-            ccsrch(inbuf);
-          }
-        } else {
-#ifdef DEBUG
-          printf("Processing file %s\n",inbuf);
-#endif
-          ccsrch(inbuf);
-        }
-      }
+    if ((ffstat.st_mode & S_IFMT) == S_IFBLK ||
+        (raw_mode && ((ffstat.st_mode & S_IFMT) == S_IFCHR || (ffstat.st_mode & S_IFMT) == S_IFREG))) {
+      scan_raw(inbuf, &ffstat);
+    } else if ((ffstat.st_size > 0) && ((ffstat.st_mode & S_IFMT) == S_IFREG)) {
+      input_is_file = 1;
+      dispatch_file(inbuf, &ffstat);
+      input_is_file = 0;
     } else if ((ffstat.st_mode & S_IFMT) == S_IFDIR) {
 #ifdef WINDOWS
       if ((inbuf[strlen(inbuf) - 1]) != '\\')
@@ -930,19 +5067,214 @@ int scanpath(char *inbuf)
   return 1;
 }
 
+enum {
+  OPT_CHECKPOINT = 256,
+  OPT_CHECKPOINT_INTERVAL,
+  OPT_RESUME,
+  OPT_MAKE_PLAN,
+  OPT_PLAN,
+  OPT_SHARD,
+  OPT_GENTLE,
+  OPT_DIRECT,
+  OPT_RATE_MB,
+  OPT_RATE_FILES,
+  OPT_RATE_OPENS,
+  OPT_IDLE_IO,
+  OPT_NICE,
+  OPT_ADAPTIVE_MS,
+  OPT_ORDER,
+  OPT_BATCH,
+  OPT_TRIAGE,
+  OPT_SAMPLE_OVER,
+  OPT_SAMPLE_BLOCKS,
+  OPT_PRIORITY,
+  OPT_DEADLINE,
+  OPT_UNREACHED,
+  OPT_AGGREGATE,
+  OPT_AGGREGATE_ONLY,
+  OPT_AGGREGATE_KEY,
+  OPT_AGGREGATE_MAX,
+  OPT_PREFETCH,
+  OPT_RAW,
+  OPT_WORKERS,
+  OPT_OWNER_MAP,
+  OPT_JSON,
+  OPT_BINARY,
+  OPT_CONVERT,
+  OPT_TRACK_ONLY,
+  OPT_CACHE,
+  OPT_CACHE_TRUST_SAMPLE,
+  OPT_PID,
+  OPT_MAX_MEMORY,
+  OPT_HUGE_PAGES
+};
+
+static const struct option long_options[] = {
+  {"checkpoint",          required_argument, NULL, OPT_CHECKPOINT},
+  {"checkpoint-interval", required_argument, NULL, OPT_CHECKPOINT_INTERVAL},
+  {"resume",              no_argument,       NULL, OPT_RESUME},
+  {"make-plan",           required_argument, NULL, OPT_MAKE_PLAN},
+  {"plan",                required_argument, NULL, OPT_PLAN},
+  {"shard",               required_argument, NULL, OPT_SHARD},
+  {"gentle",              no_argument,       NULL, OPT_GENTLE},
+  {"direct",              no_argument,       NULL, OPT_DIRECT},
+  {"rate-mb",             required_argument, NULL, OPT_RATE_MB},
+  {"rate-files",          required_argument, NULL, OPT_RATE_FILES},
+  {"rate-opens",          required_argument, NULL, OPT_RATE_OPENS},
+  {"idle-io",             no_argument,       NULL, OPT_IDLE_IO},
+  {"nice",                required_argument, NULL, OPT_NICE},
+  {"adaptive-ms",         required_argument, NULL, OPT_ADAPTIVE_MS},
+  {"order",               required_argument, NULL, OPT_ORDER},
+  {"batch",               required_argument, NULL, OPT_BATCH},
+  {"triage",              no_argument,       NULL, OPT_TRIAGE},
+  {"sample-over",         required_argument, NULL, OPT_SAMPLE_OVER},
+  {"sample-blocks",       required_argument, NULL, OPT_SAMPLE_BLOCKS},
+  {"priority",            required_argument, NULL, OPT_PRIORITY},
+  {"deadline",            required_argument, NULL, OPT_DEADLINE},
+  {"unreached",           required_argument, NULL, OPT_UNREACHED},
+  {"aggregate",           no_argument,       NULL, OPT_AGGREGATE},
+  {"aggregate-only",      no_argument,       NULL, OPT_AGGREGATE_ONLY},
+  {"aggregate-key",       required_argument, NULL, OPT_AGGREGATE_KEY},
+  {"aggregate-max",       required_argument, NULL, OPT_AGGREGATE_MAX},
+  {"prefetch",            required_argument, NULL, OPT_PREFETCH},
+  {"raw",                 no_argument,       NULL, OPT_RAW},
+  {"workers",             required_argument, NULL, OPT_WORKERS},
+  {"owner-map",           required_argument, NULL, OPT_OWNER_MAP},
+  {"json",                no_argument,       NULL, OPT_JSON},
+  {"binary",              no_argument,       NULL, OPT_BINARY},
+  {"convert",             required_argument, NULL, OPT_CONVERT},
+  {"track-only",          no_argument,       NULL, OPT_TRACK_ONLY},
+  {"cache",               required_argument, NULL, OPT_CACHE},
+  {"cache-trust-sample",  no_argument,       NULL, OPT_CACHE_TRUST_SAMPLE},
+  {"pid",                 required_argument, NULL, OPT_PID},
+  {"max-memory",          required_argument, NULL, OPT_MAX_MEMORY},
+  {"huge-pages",          no_argument,       NULL, OPT_HUGE_PAGES},
+  {NULL,                  0,                 NULL, 0}
+};
+
+static char *read_plan(const char *filename, size_t *len)
+{
+  FILE   *in;
+  char   *buf  = NULL;
+  char   *tmp  = NULL;
+  size_t  size = 0;
+  size_t  cnt  = 0;
+
+  *len = 0;
+  in = fopen(filename, "rb");
+  if (in == NULL) {
+    fprintf(stderr, "Unable to open plan %s for reading; errno=%d\n", filename, errno);
+    return NULL;
+  }
+  do {
+    if (*len + BSIZE > size) {
+      size = (size + BSIZE) * 2;
+      tmp  = (char *)realloc(buf, size);
+      if (tmp == NULL) {
+        fprintf(stderr, "read_plan: can't allocate memory; errno=%d\n", errno);
+        free(buf);
+        fclose(in);
+        return NULL;
+      }
+      buf = tmp;
+    }
+    cnt   = fread(buf + *len, 1, size - *len - 1, in);
+    *len += cnt;
+  } while (cnt > 0);
+  fclose(in);
+  buf[*len] = '\0';
+
+  if (strncmp(buf, "ccsrch-plan 1\n", 14) != 0) {
+    fprintf(stderr, "%s is not a ccsrch plan\n", filename);
+    free(buf);
+    return NULL;
+  }
+  return buf;
+}
+
+/*
+ * Scan this node's share of a plan. The files of the plan are laid end to
+ * end and shard i of N takes the i-th N-th of the bytes, splitting the
+ * files at either edge by byte range. Each shard therefore scans a run of
+ * the plan in plan order, and the -o logs of shards 1..N concatenated are
+ * the report a single run over the whole plan would have written.
+ */
+static int run_plan(void)
+{
+  char        *buf;
+  char        *rec;
+  char        *end;
+  char        *path;
+  size_t       len;
+  long         total    = 0;
+  long         pos      = 0;
+  long         size     = 0;
+  long         share_lo = 0;
+  long         share_hi = 0;
+  long         lo       = 0;
+  long         hi       = 0;
+  struct stat  fileattr;
+
+  buf = read_plan(plan_file, &len);
+  if (buf == NULL)
+    return 0;
+  end = buf + len;
+
+  for (rec = buf + 14; rec < end; rec += strlen(rec) + 1)
+    total += atol(rec);
+  share_lo = (long)((double)total * (shard_index - 1) / shard_count);
+  share_hi = (long)((double)total * shard_index / shard_count);
+  printf("Shard %d/%d of plan %s: bytes %ld-%ld of %ld\n",
+         shard_index, shard_count, plan_file, share_lo, share_hi, total);
+
+  for (rec = buf + 14; rec < end && !stop_scan; rec += strlen(rec) + 1) {
+    size = strtol(rec, &path, 10);
+    if (*path != ' ') {
+      fprintf(stderr, "run_plan: damaged record in %s\n", plan_file);
+      break;
+    }
+    path++;
+    lo   = share_lo > pos ? share_lo - pos : 0;
+    hi   = share_hi < pos + size ? share_hi - pos : size;
+    pos += size;
+    if (lo >= hi)
+      continue;
+    if (input_index < resume_input) {
+      input_index++;
+      continue;
+    }
+    if (get_file_stat(path, &fileattr) == 0) {
+      /* files split across shards are scanned by range, the rest whole */
+      scan_range_lo = lo;
+      scan_range_hi = (lo == 0 && hi == size) ? -1 : hi;
+      input_is_file = 1;
+      scan_file(path);
+      input_is_file = 0;
+      scan_range_lo = 0;
+      scan_range_hi = -1;
+    }
+    if (!stop_scan)
+      input_done();
+  }
+  free(buf);
+  return 1;
+}
+
 int main(int argc, char *argv[])
 {
   char       *tracktype_str = NULL;
   char       linebuf[8192];
+  char       *path          = NULL;
   int         c              = 0;
   int         limit_arg      = 0;
   int         success        = 1; // boolean, not exit code
   size_t      len;
+  struct stat ffstat;
 
   if (argc < 2)
     usage(argv[0]);
 
-  while ((c = getopt(argc, argv,"abefi:jt:To:cml:n:sDFC")) != -1) {
+  while ((c = getopt_long(argc, argv,"abefi:jt:To:cml:n:sDFC0", long_options, NULL)) != -1) {
       switch (c) {
         case 'D':
           dirs_from_stdin = 1;
@@ -950,6 +5282,9 @@ int main(int argc, char *argv[])
         case 'F':
           files_from_stdin = 1;
           break;
+        case '0':
+          input_delim = '\0';
+          break;
         case 'C':
           print_csv = 1;
           break;
@@ -1011,6 +5346,163 @@ int main(int argc, char *argv[])
         	newstatus = 1;
 
         	break;
+        case OPT_CHECKPOINT:
+          checkpoint_file = optarg;
+          break;
+        case OPT_CHECKPOINT_INTERVAL:
+          checkpoint_interval = atoi(optarg);
+          if (checkpoint_interval < 0)
+            usage(argv[0]);
+          break;
+        case OPT_RESUME:
+          resume_scan = 1;
+          break;
+        case OPT_MAKE_PLAN:
+          plan_out_file = optarg;
+          break;
+        case OPT_PLAN:
+          plan_file = optarg;
+          break;
+        case OPT_SHARD:
+          if (sscanf(optarg, "%d/%d", &shard_index, &shard_count) != 2 ||
+              shard_count < 1 || shard_index < 1 || shard_index > shard_count)
+            usage(argv[0]);
+          break;
+        case OPT_GENTLE:
+          gentle_io = 1;
+          break;
+        case OPT_DIRECT:
+          gentle_io = 1;
+          direct_io = 1;
+          break;
+        case OPT_RATE_MB:
+          bucket_init(&byte_bucket, atof(optarg) * 1024 * 1024);
+          break;
+        case OPT_RATE_FILES:
+          bucket_init(&file_bucket, atof(optarg));
+          break;
+        case OPT_RATE_OPENS:
+          bucket_init(&open_bucket, atof(optarg));
+          break;
+        case OPT_IDLE_IO:
+          idle_io = 1;
+          break;
+        case OPT_NICE:
+          nice_level = atoi(optarg);
+          break;
+        case OPT_ADAPTIVE_MS:
+          adaptive_latency = atof(optarg);
+          if (adaptive_latency <= 0)
+            usage(argv[0]);
+          break;
+        case OPT_ORDER:
+          if (strcmp(optarg, "inode") == 0)
+            scan_order = ORDER_INODE;
+          else if (strcmp(optarg, "extent") == 0)
+            scan_order = ORDER_EXTENT;
+          else if (strcmp(optarg, "walk") == 0)
+            scan_order = ORDER_WALK;
+          else
+            usage(argv[0]);
+          break;
+        case OPT_BATCH:
+          if (atol(optarg) < 1)
+            usage(argv[0]);
+          batch.limit = atol(optarg);
+          break;
+        case OPT_TRIAGE:
+          triage_mode = 1;
+          break;
+        case OPT_SAMPLE_OVER:
+          sample_threshold = atol(optarg) * 1024 * 1024;
+          if (sample_threshold <= 0)
+            usage(argv[0]);
+          break;
+        case OPT_SAMPLE_BLOCKS:
+          sample_blocks = atoi(optarg);
+          if (sample_blocks < 0)
+            usage(argv[0]);
+          break;
+        case OPT_PRIORITY:
+          if (load_priority_policy(optarg) < 0)
+            exit(-1);
+          scan_order = ORDER_PRIORITY;
+          break;
+        case OPT_DEADLINE:
+          deadline = parse_deadline(optarg);
+          if (deadline == 0)
+            usage(argv[0]);
+          break;
+        case OPT_UNREACHED:
+          unreached_file = optarg;
+          break;
+        case OPT_AGGREGATE:
+          aggregate_mode = 1;
+          break;
+        case OPT_AGGREGATE_ONLY:
+          aggregate_mode = 1;
+          aggregate_only = 1;
+          break;
+        case OPT_AGGREGATE_KEY:
+          aggregate_key = optarg;
+          break;
+        case OPT_TRACK_ONLY:
+          track_mode = 1;
+          break;
+        case OPT_CACHE:
+          cache_file = optarg;
+          break;
+        case OPT_CACHE_TRUST_SAMPLE:
+          cache_trust_sample = 1;
+          break;
+        case OPT_MAX_MEMORY:
+          pool.limit = parse_memory(optarg);
+          if (pool.limit == 0) {
+            fprintf(stderr, "main: --max-memory takes MB, or a number with a K, M or G suffix\n");
+            exit(-1);
+          }
+          break;
+        case OPT_HUGE_PAGES:
+          pool.huge = 1;
+          break;
+        case OPT_PID:
+#ifdef __linux__
+          pid_list = optarg;
+#else
+          fprintf(stderr, "main: --pid is only supported on Linux\n");
+          exit(-1);
+#endif
+          break;
+        case OPT_JSON:
+          output_format = FORMAT_JSON;
+          break;
+        case OPT_BINARY:
+          output_format = FORMAT_BINARY;
+          break;
+        case OPT_CONVERT:
+          convert_file = optarg;
+          break;
+        case OPT_RAW:
+          raw_mode = 1;
+          break;
+        case OPT_WORKERS:
+          raw_workers = atoi(optarg);
+          if (raw_workers < 1)
+            usage(argv[0]);
+          break;
+        case OPT_OWNER_MAP:
+          owner_map_root = optarg;
+          break;
+        case OPT_PREFETCH:
+          prefetch_window = atoi(optarg);
+          if (prefetch_window < 0)
+            usage(argv[0]);
+          break;
+        case OPT_AGGREGATE_MAX:
+          aggregate_max = atol(optarg);
+          if (aggregate_max < 1)
+            usage(argv[0]);
+          break;
         case 'h':
         default:
           usage(argv[0]);
@@ -1027,31 +5519,101 @@ int main(int argc, char *argv[])
   	newstatus = 0;
   	print_file_hit_count = 0;
   }
+  if (resume_scan && checkpoint_file == NULL) {
+    fprintf(stderr, "main: --resume needs --checkpoint <file>\n");
+    exit(-1);
+  }
+  if (track_mode) {
+    tracksrch = 1;
+    if (!tracktype1 && !tracktype2)
+      tracktype1 = tracktype2 = 1;
+  }
+  if (convert_file != NULL) {
+    output_format = FORMAT_TEXT;
+    if (open_logfile() < 0)
+      exit(-1);
+    exit(convert_log(convert_file) < 0 ? 1 : 0);
+  }
+  if (output_format == FORMAT_BINARY && logfilename == NULL) {
+    fprintf(stderr, "main: --binary needs -o <file>\n");
+    exit(-1);
+  }
+  if (triage_mode && raw_workers > 1) {
+    fprintf(stderr, "main: --triage reports on whole files and can't be used with --workers\n");
+    exit(-1);
+  }
+  if (plan_out_file != NULL && plan_file != NULL) {
+    fprintf(stderr, "main: --make-plan and --plan can't be used together\n");
+    exit(-1);
+  }
+  if (shard_count > 1 && plan_file == NULL) {
+    fprintf(stderr, "main: --shard needs --plan, or every node would scan everything\n");
+    exit(-1);
+  }
+  if (plan_out_file != NULL && open_plan_out() < 0)
+    exit(-1);
+  if (aggregate_mode && set_aggregate_key(aggregate_key) < 0) {
+    fprintf(stderr, "main: --aggregate-key takes 32 hex digits\n");
+    exit(-1);
+  }
+  if (batch.limit == 0)
+    batch.limit = scan_order == ORDER_PRIORITY ? (size_t)-1 : 4096;
+  if (unreached_file != NULL) {
+    unreached_out = fopen(unreached_file, "w");
+    if (unreached_out == NULL) {
+      fprintf(stderr, "Unable to open %s for writing; errno=%d\n", unreached_file, errno);
+      exit(-1);
+    }
+  }
 
-  if (open_logfile() < 0)
+  if (open_logfile() < 0 || alloc_io_buf() < 0)
     exit(-1);
+  lower_priority();
   signal_proc();
   init_time = time(NULL);
   printf("\n%s\n", PROG_VER);
   printf("\nLocal start time: %s\n",ctime((time_t *)&init_time));
+  last_checkpoint = init_time;
+  if (resume_scan && read_checkpoint() < 0)
+    exit(-1);
+  if (owner_map_root != NULL && load_owner_map(owner_map_root) < 0)
+    exit(-1);
+  if (cache_file != NULL && open_cache() < 0)
+    exit(-1);
 
-  if (dirs_from_stdin) {
+  if (plan_file != NULL) {
+    success = run_plan();
+#ifdef __linux__
+  } else if (pid_list != NULL) {
+    success = scan_processes(pid_list);
+#endif
+  } else if (dirs_from_stdin) {
     printf("Reading dirs from standard input...\n");
-    while (fgets(linebuf, sizeof linebuf, stdin) != NULL) {
-      chomp(linebuf);
+    while (!stop_scan && (path = next_input_path()) != NULL) {
+      if (input_index < resume_input) {
+        input_index++;
+        continue;
+      }
       // success is 0 if any result is 0
-      success &= scanpath(linebuf);
+      success &= scanpath(path);
+      if (!stop_scan)
+        input_done();
     }
   } else if (files_from_stdin) {
     printf("Reading filenames from standard input...\n");
-    while (fgets(linebuf, sizeof linebuf, stdin) != NULL) {
-      chomp(linebuf);
-      if (is_allowed_file_type(linebuf) != 0) // inverted bool
+    while (!stop_scan && (path = next_input_path()) != NULL) {
+      if (input_index < resume_input) {
+        input_index++;
         continue;
-      file_hit_count = 0;
-      ccsrch(linebuf);
-      if (file_hit_count > 0 && print_file_hit_count == 1)
-        printf("%s: %d hits\n", linebuf, file_hit_count);
+      }
+      if (is_allowed_file_type(path) == 0 && // inverted bool
+          get_file_stat(path, &ffstat) == 0) {
+        input_is_file = 1;
+        dispatch_file(path, &ffstat);
+        input_is_file = 0;
+      }
+      if (!stop_scan)
+        input_done();
     }
   } else {
     if (argv[optind] == NULL)
@@ -1062,8 +5624,27 @@ int main(int argc, char *argv[])
       exit(-1);
     }
     strncpy(linebuf, argv[optind], strlen(argv[optind])+2);
-    success = scanpath(linebuf);
+    if (input_index < resume_input) {
+      printf("Checkpoint %s shows this scan already finished\n", checkpoint_file);
+    } else {
+      success = scanpath(linebuf);
+      if (!stop_scan)
+        input_done();
+    }
+  }
+  if (!stop_scan)
+    flush_batch();
+  if (plan_out != NULL) {
+    fclose(plan_out);
+    printf("Plan written to %s: %ld files, %ld bytes\n", plan_out_file, plan_files, plan_bytes);
+    exit(0);
   }
+  if (aggregate_mode)
+    print_aggregate();
+  if (stop_scan)
+    printf("\nScan interrupted\n");
+  if (checkpoint_file != NULL && write_checkpoint() == 0)
+    printf("Checkpoint saved to %s\n", checkpoint_file);
   cleanup_shtuff(0);
   return success ? 0 : 1;
 }